@@ -0,0 +1,330 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <libpmemobj.h>
+
+#include "MPMCQueue.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// Location of a payload in the arena of an ArenaQueue. The persistent slots
+/// hold this instead of the payload.
+struct ArenaRef {
+  uint32_t chunk; // first chunk of the payload
+  uint32_t size;  // payload bytes
+};
+
+/// Converts T to and from the bytes stored in the arena. Specialize it for
+/// other types that are not trivially copyable.
+template <typename T>
+struct ArenaCodec {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "ArenaCodec must be specialized for T");
+
+  static std::span<const std::byte> bytes(const T& v) noexcept {
+    return std::as_bytes(std::span<const T, 1>{&v, 1});
+  }
+  /// Returns the storage of v to read a payload of size bytes into.
+  static std::span<std::byte> resize(T& v, size_t) noexcept {
+    return std::as_writable_bytes(std::span<T, 1>{&v, 1});
+  }
+};
+
+template <typename C, typename Traits, typename A>
+struct ArenaCodec<std::basic_string<C, Traits, A>> {
+  using String = std::basic_string<C, Traits, A>;
+
+  static std::span<const std::byte> bytes(const String& v) noexcept {
+    return std::as_bytes(std::span<const C>{v.data(), v.size()});
+  }
+  static std::span<std::byte> resize(String& v, size_t size) {
+    v.resize(size / sizeof(C));
+    return std::as_writable_bytes(std::span<C>{v.data(), v.size()});
+  }
+};
+
+template <typename E, typename A>
+struct ArenaCodec<std::vector<E, A>> {
+  static_assert(std::is_trivially_copyable<E>::value,
+                "ArenaCodec must be specialized for std::vector<E>");
+  using Vector = std::vector<E, A>;
+
+  static std::span<const std::byte> bytes(const Vector& v) noexcept {
+    return std::as_bytes(std::span<const E>{v.data(), v.size()});
+  }
+  static std::span<std::byte> resize(Vector& v, size_t size) {
+    v.resize(size / sizeof(E));
+    return std::as_writable_bytes(std::span<E>{v.data(), v.size()});
+  }
+};
+
+/// Persistent queue of payloads of any type and size. The slots of the
+/// underlying Queue only hold an ArenaRef; the payload is written once, with
+/// non-temporal stores, to fixed size chunks of an arena in the same pool and
+/// its chunks are reused as soon as it is popped. Payloads larger than a chunk
+/// are chained over several chunks.
+///
+/// The free chunks are only tracked in DRAM and Recover() rebuilds them from
+/// the payloads still in the queue, so pushing never needs a pmemobj
+/// transaction and a crash cannot leak arena space. A pool must be reopened
+/// with the same arenaBytes and chunkSize, and Recover() must run before the
+/// reopened queue is used, after a crash or a clean shutdown alike.
+template <typename T, typename Codec = ArenaCodec<T>>
+class ArenaQueue {
+  // Header at the start of every chunk, the payload follows
+  struct Chunk {
+    uint32_t next; // next chunk of the same payload
+    uint32_t size; // payload bytes in this chunk
+  };
+  static constexpr uint32_t NoChunk = std::numeric_limits<uint32_t>::max();
+
+  static size_t CheckChunks(size_t arenaBytes, size_t chunkSize) {
+    if (chunkSize <= sizeof(Chunk) || chunkSize % alignof(Chunk) != 0) {
+      throw std::invalid_argument("invalid chunk size");
+    }
+    auto const chunks = arenaBytes / chunkSize;
+    if (chunks < 1 || chunks >= NoChunk) {
+      throw std::invalid_argument("invalid arena size");
+    }
+    return chunks;
+  }
+
+public:
+  ArenaQueue(size_t capacity, std::string poolPath, size_t arenaBytes,
+             size_t chunkSize = 256)
+      : chunkSize_(chunkSize), chunks_(CheckChunks(arenaBytes, chunkSize)),
+        q_(capacity, true, std::move(poolPath), {}, chunks_ * chunkSize_),
+        arena_(q_.root_->arena_.get()),
+        freeNext_(new std::atomic<uint32_t>[chunks_]) {
+    BuildFreeList({});
+  }
+
+  // non-copyable and non-movable
+  ArenaQueue(const ArenaQueue&) = delete;
+  ArenaQueue& operator=(const ArenaQueue&) = delete;
+
+  /// Writes v to the arena and enqueues a reference to it. Blocks if the
+  /// queue is full or until enough chunks are free; producers waiting for
+  /// chunks get them in the order they started to wait.
+  void push(const T& v) {
+    auto const bytes = Codec::bytes(v);
+    auto const payload = chunkSize_ - sizeof(Chunk);
+    auto const n = std::max<size_t>(1, (bytes.size() + payload - 1) / payload);
+    if (bytes.size() > std::numeric_limits<uint32_t>::max() || n > chunks_) {
+      throw std::length_error("payload exceeds arena");
+    }
+
+    // Reserve all chunks before taking any, so that producers waiting for
+    // space cannot each hold part of the arena
+    Reserve(n);
+    auto const first = AllocChunks(n);
+
+    size_t offset = 0;
+    for (auto c = first; c != NoChunk;) {
+      auto const next = freeNext_[c].load(std::memory_order_relaxed);
+      auto const size = std::min(payload, bytes.size() - offset);
+      const Chunk header{next, static_cast<uint32_t>(size)};
+      pmemobj_memcpy(q_.pop_.handle(), chunk(c), &header, sizeof(header),
+                     PMEMOBJ_F_MEM_NODRAIN);
+      pmemobj_memcpy(q_.pop_.handle(), chunk(c) + 1, bytes.data() + offset,
+                     size, PMEMOBJ_F_MEM_NONTEMPORAL | PMEMOBJ_F_MEM_NODRAIN);
+      offset += size;
+      c = next;
+    }
+    // The payload must be durable before the slot refers to it
+    q_.pop_.drain();
+    q_.push(ArenaRef{first, static_cast<uint32_t>(bytes.size())});
+  }
+
+  /// Dequeues a payload into v and frees its chunks. Blocks if the queue is
+  /// empty. If Codec::resize() throws, e.g. std::bad_alloc, the payload is
+  /// dropped: it is already dequeued, its chunks are freed and the exception
+  /// is rethrown.
+  void pop(T& v) {
+    ArenaRef ref;
+    q_.pop(ref);
+    std::span<std::byte> out;
+    try {
+      out = Codec::resize(v, ref.size);
+    } catch (...) {
+      FreeChunks(ref.chunk);
+      throw;
+    }
+    size_t offset = 0;
+    for (auto c = ref.chunk; c != NoChunk;) {
+      auto const* header = chunk(c);
+      auto const size = std::min<size_t>(header->size, out.size() - offset);
+      std::memcpy(out.data() + offset, header + 1, size);
+      offset += size;
+      auto const next = header->next;
+      FreeChunk(c);
+      c = next;
+    }
+  }
+
+  /// Recovers the underlying queue and rebuilds the free chunks from the
+  /// payloads still in it. Not thread safe.
+  void Recover() {
+    q_.Recover();
+    std::vector<bool> used(chunks_);
+    auto const head = q_.head_.load(std::memory_order_relaxed);
+    for (auto t = q_.tail_.load(std::memory_order_relaxed); t != head; ++t) {
+      auto const ref = q_.pSlots_[q_.idx(t)].get_ro().move();
+      for (auto c = ref.chunk; c != NoChunk; c = chunk(c)->next)
+        used[c] = true;
+    }
+    BuildFreeList(used);
+  }
+
+  ptrdiff_t size() const noexcept { return q_.size(); }
+  bool empty() const noexcept { return q_.empty(); }
+
+  /// By default the pool, with the payloads still in it, is deleted with the
+  /// queue. With keep set it is kept and marked as cleanly shut down, see
+  /// Queue::keep_pool().
+  void keep_pool(bool keep) noexcept { q_.keep_pool(keep); }
+
+private:
+  Chunk* chunk(uint32_t c) const noexcept {
+    return reinterpret_cast<Chunk*>(arena_ + static_cast<size_t>(c) * chunkSize_);
+  }
+
+  void BuildFreeList(const std::vector<bool>& used) noexcept {
+    uint32_t top = NoChunk;
+    size_t count = 0;
+    for (auto c = static_cast<uint32_t>(chunks_); c-- > 0;) {
+      if (c < used.size() && used[c])
+        continue;
+      freeNext_[c].store(top, std::memory_order_relaxed);
+      top = c;
+      ++count;
+    }
+    freeTop_.store(top, std::memory_order_relaxed);
+    freeCount_.store(count, std::memory_order_release);
+  }
+
+  // The free list is a Treiber stack, the upper half of freeTop_ counts
+  // updates to avoid ABA
+  uint32_t AllocChunk() noexcept {
+    auto top = freeTop_.load(std::memory_order_acquire);
+    for (;;) {
+      auto const c = static_cast<uint32_t>(top);
+      if (c == NoChunk)
+        return NoChunk;
+      auto const next = ((top >> 32) + 1) << 32 |
+                        freeNext_[c].load(std::memory_order_relaxed);
+      if (freeTop_.compare_exchange_weak(top, next, std::memory_order_acquire))
+        return c;
+    }
+  }
+
+  void FreeChunk(uint32_t c) noexcept {
+    auto top = freeTop_.load(std::memory_order_relaxed);
+    do {
+      freeNext_[c].store(static_cast<uint32_t>(top), std::memory_order_relaxed);
+    } while (!freeTop_.compare_exchange_weak(top, ((top >> 32) + 1) << 32 | c,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+    freeCount_.fetch_add(1, std::memory_order_release);
+  }
+
+  // Frees the chunks of the payload starting at first
+  void FreeChunks(uint32_t first) noexcept {
+    for (auto c = first; c != NoChunk;) {
+      auto const next = chunk(c)->next;
+      FreeChunk(c);
+      c = next;
+    }
+  }
+
+  // Reserves n of the free chunks, waiting until there are enough. Once a
+  // producer has to wait, the others queue behind it in ticket order instead
+  // of taking chunks, so a payload that needs most of the arena is not
+  // starved by smaller ones taking every chunk as soon as it is freed.
+  void Reserve(size_t n) noexcept {
+    if (waiting_.load(std::memory_order_acquire) == 0 && TryReserve(n))
+      return;
+    waiting_.fetch_add(1, std::memory_order_acq_rel);
+    auto const ticket = nextTicket_.fetch_add(1, std::memory_order_relaxed);
+    while (serving_.load(std::memory_order_acquire) != ticket)
+      std::this_thread::yield();
+    while (!TryReserve(n))
+      std::this_thread::yield();
+    serving_.store(ticket + 1, std::memory_order_release);
+    waiting_.fetch_sub(1, std::memory_order_release);
+  }
+
+  bool TryReserve(size_t n) noexcept {
+    auto free = freeCount_.load(std::memory_order_acquire);
+    do {
+      if (free < n)
+        return false;
+    } while (!freeCount_.compare_exchange_weak(free, free - n,
+                                               std::memory_order_acquire));
+    return true;
+  }
+
+  // Takes n reserved chunks, linked through freeNext_. The free list holds
+  // at least as many chunks as are reserved and not taken yet.
+  uint32_t AllocChunks(size_t n) noexcept {
+    uint32_t first = NoChunk;
+    for (size_t i = 0; i < n; ++i) {
+      auto const c = AllocChunk();
+      assert(c != NoChunk);
+      freeNext_[c].store(first, std::memory_order_relaxed);
+      first = c;
+    }
+    return first;
+  }
+
+  const size_t chunkSize_;
+  const size_t chunks_;
+  Queue<ArenaRef> q_;
+  char* arena_;
+  std::unique_ptr<std::atomic<uint32_t>[]> freeNext_;
+  alignas(hardwareInterferenceSize) std::atomic<uint64_t> freeTop_{NoChunk};
+  std::atomic<size_t> freeCount_{0}; // free chunks not reserved
+  // Producers waiting for chunks, served in ticket order
+  alignas(hardwareInterferenceSize) std::atomic<size_t> waiting_{0};
+  std::atomic<size_t> nextTicket_{0};
+  std::atomic<size_t> serving_{0};
+};
+} // namespace mpmc
+} // namespace rigtorp
@@ -0,0 +1,330 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "MPMCQueue.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// Resumes a coroutine on the thread that made it ready.
+struct InlineExecutor {
+  void operator()(std::coroutine_handle<> h) const { h.resume(); }
+};
+
+/// Volatile queue whose push and pop can also be awaited from C++20
+/// coroutines: `T v = co_await q.async_pop()` and
+/// `co_await q.async_push(v)`.
+///
+/// An awaited operation takes its ticket like push() and pop() and completes
+/// without suspending when the slot already has its turn. Otherwise the
+/// coroutine is registered on the slot and resumed through the executor, a
+/// callable taking a std::coroutine_handle<>, by the operation that stores
+/// the turn it waits for. No thread spins for a suspended coroutine, so many
+/// of them can share a few threads. The blocking and try_ operations follow
+/// the ticket protocol of Queue, with a blocking one yielding while it
+/// waits, and may be mixed with the awaited ones.
+///
+/// Resumes happen on a trampoline: a coroutine made ready while the thread
+/// is already resuming one, e.g. by a push from inside a resumed coroutine
+/// with InlineExecutor, is handed to the executor once that resume returns.
+/// A pipeline of coroutines therefore does not grow the stack with its
+/// length. The executor must not throw, it is called from noexcept push and
+/// pop.
+///
+/// A ticket is taken when the operation is awaited: the awaiting coroutine
+/// must not be destroyed before it is resumed, or the ticket is never served.
+template <typename T, typename Executor = InlineExecutor>
+class AsyncQueue {
+  // A suspended coroutine waiting for a turn of a slot
+  struct Waiter {
+    size_t turn;
+    std::coroutine_handle<> handle;
+    Waiter* next = nullptr;
+    AsyncQueue* queue = nullptr; // whose executor resumes it
+  };
+
+  // Waiters made ready by the resumes running on this thread
+  struct Trampoline {
+    bool running = false;
+    Waiter* first = nullptr;
+    Waiter* last = nullptr;
+  };
+
+  struct Cell : Slot<T> {
+    // Registered waiters, read by the operations storing the turn
+    std::atomic<uint32_t> waiters = {0};
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+    Waiter* list = nullptr;
+  };
+
+public:
+  class PushAwaiter {
+  public:
+    bool await_ready() noexcept {
+      ticket_ = q_.head_.fetch_add(1);
+      return q_.Ready(ticket_, 0);
+    }
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+      return q_.Suspend(ticket_, 0, waiter_, h);
+    }
+    void await_resume() noexcept { q_.Publish(ticket_, std::move(v_)); }
+
+  private:
+    friend class AsyncQueue;
+    PushAwaiter(AsyncQueue& q, T v) : q_(q), v_(std::move(v)) {}
+
+    AsyncQueue& q_;
+    T v_;
+    size_t ticket_ = 0;
+    Waiter waiter_;
+  };
+
+  class PopAwaiter {
+  public:
+    bool await_ready() noexcept {
+      ticket_ = q_.tail_.fetch_add(1);
+      return q_.Ready(ticket_, 1);
+    }
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+      return q_.Suspend(ticket_, 1, waiter_, h);
+    }
+    T await_resume() noexcept { return q_.Consume(ticket_); }
+
+  private:
+    friend class AsyncQueue;
+    explicit PopAwaiter(AsyncQueue& q) : q_(q) {}
+
+    AsyncQueue& q_;
+    size_t ticket_ = 0;
+    Waiter waiter_;
+  };
+
+  explicit AsyncQueue(size_t capacity, Executor executor = Executor())
+      : capacity_(capacity), executor_(std::move(executor)) {
+    if (capacity_ < 1) {
+      throw std::invalid_argument("capacity < 1");
+    }
+    // Allocate one extra cell to prevent false sharing on the last cell
+    cells_.reset(new Cell[capacity_ + 1]);
+    static_assert(std::is_nothrow_move_constructible<T>::value,
+                  "T must be nothrow move constructible");
+  }
+
+  // non-copyable and non-movable
+  AsyncQueue(const AsyncQueue&) = delete;
+  AsyncQueue& operator=(const AsyncQueue&) = delete;
+
+  /// Awaitable enqueue of v.
+  PushAwaiter async_push(T v) noexcept(std::is_nothrow_move_constructible<T>::value) {
+    return PushAwaiter(*this, std::move(v));
+  }
+
+  /// Awaitable dequeue, the result of co_await is the item.
+  PopAwaiter async_pop() noexcept { return PopAwaiter(*this); }
+
+  void push(T v) noexcept {
+    auto const head = head_.fetch_add(1);
+    while (!Ready(head, 0))
+      std::this_thread::yield();
+    Publish(head, std::move(v));
+  }
+
+  bool try_push(T v) noexcept {
+    auto head = head_.load(std::memory_order_acquire);
+    for (;;) {
+      if (Ready(head, 0)) {
+        if (head_.compare_exchange_strong(head, head + 1)) {
+          Publish(head, std::move(v));
+          return true;
+        }
+      } else {
+        auto const prevHead = head;
+        head = head_.load(std::memory_order_acquire);
+        if (head == prevHead)
+          return false;
+      }
+    }
+  }
+
+  void pop(T& v) noexcept {
+    auto const tail = tail_.fetch_add(1);
+    while (!Ready(tail, 1))
+      std::this_thread::yield();
+    v = Consume(tail);
+  }
+
+  bool try_pop(T& v) noexcept {
+    auto tail = tail_.load(std::memory_order_acquire);
+    for (;;) {
+      if (Ready(tail, 1)) {
+        if (tail_.compare_exchange_strong(tail, tail + 1)) {
+          v = Consume(tail);
+          return true;
+        }
+      } else {
+        auto const prevTail = tail;
+        tail = tail_.load(std::memory_order_acquire);
+        if (tail == prevTail)
+          return false;
+      }
+    }
+  }
+
+  /// Returns the number of elements in the queue, negative while consumers
+  /// wait. Since this is a concurrent queue the size is only a best effort
+  /// guess until all reader and writer threads have been joined.
+  ptrdiff_t size() const noexcept {
+    return static_cast<ptrdiff_t>(head_.load(std::memory_order_relaxed) -
+                                  tail_.load(std::memory_order_relaxed));
+  }
+
+  bool empty() const noexcept { return size() <= 0; }
+
+private:
+  constexpr size_t idx(size_t i) const noexcept { return i % capacity_; }
+  constexpr size_t turn(size_t i) const noexcept { return i / capacity_; }
+
+  // The turn of the slot of ticket to push (parity 0) or pop (parity 1)
+  size_t Want(size_t ticket, size_t parity) const noexcept {
+    return turn(ticket) * 2 + parity;
+  }
+
+  bool Ready(size_t ticket, size_t parity) const noexcept {
+    return cells_[idx(ticket)].turn.load(std::memory_order_acquire) ==
+           Want(ticket, parity);
+  }
+
+  static void Lock(Cell& cell) noexcept {
+    while (cell.lock.test_and_set(std::memory_order_acquire))
+      std::this_thread::yield();
+  }
+  static void Unlock(Cell& cell) noexcept {
+    cell.lock.clear(std::memory_order_release);
+  }
+
+  // Registers h on the slot of ticket. Returns false, and h continues right
+  // away, if the turn arrived meanwhile.
+  bool Suspend(size_t ticket, size_t parity, Waiter& w,
+               std::coroutine_handle<> h) noexcept {
+    auto& cell = cells_[idx(ticket)];
+    Lock(cell);
+    // Announce the waiter before checking the turn again, pairs with the
+    // fence in Handover()
+    cell.waiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (Ready(ticket, parity)) {
+      cell.waiters.fetch_sub(1, std::memory_order_relaxed);
+      Unlock(cell);
+      return false;
+    }
+    w.turn = Want(ticket, parity);
+    w.handle = h;
+    w.queue = this;
+    w.next = cell.list;
+    cell.list = &w;
+    Unlock(cell);
+    return true;
+  }
+
+  // Stores the turn of the slot and resumes the coroutine waiting for it
+  void Handover(Cell& cell, size_t turn) noexcept {
+    cell.turn.store(turn, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (cell.waiters.load(std::memory_order_relaxed) == 0)
+      return;
+    Waiter* ready = nullptr;
+    Lock(cell);
+    // A turn belongs to one ticket, so at most one waiter matches
+    for (auto** w = &cell.list; *w != nullptr; w = &(*w)->next) {
+      if ((*w)->turn == turn) {
+        ready = *w;
+        *w = (*w)->next;
+        cell.waiters.fetch_sub(1, std::memory_order_relaxed);
+        break;
+      }
+    }
+    Unlock(cell);
+    if (ready != nullptr)
+      Resume(ready);
+  }
+
+  // Queues w on the trampoline of this thread, and runs it unless a resume
+  // further up the stack already does
+  static void Resume(Waiter* w) noexcept {
+    static thread_local Trampoline t;
+    w->next = nullptr;
+    if (t.last != nullptr)
+      t.last->next = w;
+    else
+      t.first = w;
+    t.last = w;
+    if (t.running)
+      return;
+    t.running = true;
+    while (t.first != nullptr) {
+      // The waiter lives in the coroutine frame, done with it before the
+      // resume
+      auto* next = t.first;
+      t.first = next->next;
+      if (t.first == nullptr)
+        t.last = nullptr;
+      next->queue->executor_(next->handle);
+    }
+    t.running = false;
+  }
+
+  void Publish(size_t head, T&& v) noexcept {
+    auto& cell = cells_[idx(head)];
+    cell.construct(std::move(v));
+    Handover(cell, turn(head) * 2 + 1);
+  }
+
+  T Consume(size_t tail) noexcept {
+    auto& cell = cells_[idx(tail)];
+    T v = cell.move();
+    cell.destroy();
+    Handover(cell, turn(tail) * 2 + 2);
+    return v;
+  }
+
+  const size_t capacity_;
+  Executor executor_;
+  std::unique_ptr<Cell[]> cells_;
+
+  // Align to avoid false sharing between head_ and tail_
+  alignas(hardwareInterferenceSize) std::atomic<size_t> head_{0};
+  alignas(hardwareInterferenceSize) std::atomic<size_t> tail_{0};
+};
+} // namespace mpmc
+} // namespace rigtorp
@@ -0,0 +1,451 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+#include <libpmem.h>
+
+#include "MPMCQueue.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// Control block at the start of the storage of a ByteQueue
+struct ByteQueueControl {
+  static constexpr uint64_t Magic = 0x4d504d4342595445; // "MPMCBYTE"
+  uint64_t magic;
+  uint64_t capacity;
+  // Bytes of the ring consumed and free for reuse, as a logical offset
+  std::atomic<uint64_t> released;
+};
+
+/// Ring storage in DRAM.
+class VolatileByteStorage {
+public:
+  explicit VolatileByteStorage(size_t capacity)
+      : size_(hardwareInterferenceSize + capacity),
+        base_(static_cast<std::byte*>(::operator new(
+            size_, std::align_val_t{hardwareInterferenceSize}))) {
+    std::memset(base_, 0, size_);
+  }
+  ~VolatileByteStorage() noexcept {
+    ::operator delete(base_, std::align_val_t{hardwareInterferenceSize});
+  }
+  VolatileByteStorage(const VolatileByteStorage&) = delete;
+  VolatileByteStorage& operator=(const VolatileByteStorage&) = delete;
+
+  static constexpr bool Persistent = false;
+
+  std::byte* data() const noexcept { return base_; }
+  void flush(const void*, size_t) const noexcept {}
+  void drain() const noexcept {}
+  void persist(const void*, size_t) const noexcept {}
+
+private:
+  size_t size_;
+  std::byte* base_;
+};
+
+/// Ring storage in a file mapped with libpmem. On a file system without DAX
+/// the writes are made durable with msync.
+class PmemByteStorage {
+public:
+  PmemByteStorage(const std::string& path, size_t capacity) {
+    int isPmem;
+    base_ = static_cast<std::byte*>(
+        pmem_map_file(path.c_str(), hardwareInterferenceSize + capacity,
+                      PMEM_FILE_CREATE, 0666, &size_, &isPmem));
+    if (base_ == nullptr) {
+      throw std::runtime_error(std::string("pmem_map_file: ") + pmem_errormsg());
+    }
+    isPmem_ = isPmem != 0;
+  }
+  ~PmemByteStorage() noexcept { pmem_unmap(base_, size_); }
+  PmemByteStorage(const PmemByteStorage&) = delete;
+  PmemByteStorage& operator=(const PmemByteStorage&) = delete;
+
+  static constexpr bool Persistent = true;
+
+  std::byte* data() const noexcept { return base_; }
+  void flush(const void* addr, size_t len) const noexcept {
+    if (isPmem_)
+      pmem_flush(addr, len);
+    else
+      pmem_msync(addr, len);
+  }
+  void drain() const noexcept {
+    if (isPmem_)
+      pmem_drain();
+  }
+  void persist(const void* addr, size_t len) const noexcept {
+    flush(addr, len);
+    drain();
+  }
+
+private:
+  std::byte* base_;
+  size_t size_;
+  bool isPmem_;
+};
+
+/// Bounded multi-producer multi-consumer queue of variable length byte
+/// records, stored back to back in a byte ring.
+///
+/// Like the slot queue, producers take the next position from head_ and
+/// consumers from tail_, but positions are byte offsets: a producer reserves
+/// header and payload with a CAS on head_, padding to the start of the ring
+/// when the record would wrap. Every record starts with a 16 byte header
+/// whose state holds the logical offset of the record, which tells records
+/// of different laps apart the same way turns do. Consumers get a Record
+/// that views the payload in place; its space is reused once it and every
+/// record before it have been released.
+///
+/// With PmemByteStorage a record is durable once push() returns; Recover()
+/// restores the committed records that follow the released space. A push
+/// persists the header of its reservation before it copies the payload, and
+/// these headers become durable in the order of the reservations, so a push
+/// that never returned only leaves a gap that Recover() skips.
+template <typename Storage = VolatileByteStorage>
+class ByteQueue {
+  struct Header {
+    std::atomic<uint64_t> state; // logical offset << 2 | kind
+    uint32_t size;               // payload bytes
+    uint32_t length;             // header, payload and alignment
+  };
+  static_assert(sizeof(Header) == 16, "Header must be 16 bytes");
+  static constexpr size_t Align = sizeof(Header);
+
+  enum Kind : uint64_t { Empty = 0, Committed = 1, Padding = 2, Released = 3 };
+
+public:
+  /// A record popped from the queue, valid until it is destroyed.
+  class Record {
+  public:
+    Record(Record&& other) noexcept
+        : q_(other.q_), offset_(other.offset_), data_(other.data_) {
+      other.q_ = nullptr;
+    }
+    Record& operator=(Record&& other) noexcept {
+      if (this != &other) {
+        reset();
+        q_ = other.q_;
+        offset_ = other.offset_;
+        data_ = other.data_;
+        other.q_ = nullptr;
+      }
+      return *this;
+    }
+    ~Record() noexcept { reset(); }
+
+    std::span<const std::byte> data() const noexcept { return data_; }
+    size_t size() const noexcept { return data_.size(); }
+
+    /// Releases the record early.
+    void reset() noexcept {
+      if (q_ != nullptr)
+        q_->Release(offset_);
+      q_ = nullptr;
+    }
+
+  private:
+    friend class ByteQueue;
+    Record(ByteQueue* q, uint64_t offset, std::span<const std::byte> data)
+        : q_(q), offset_(offset), data_(data) {}
+
+    ByteQueue* q_;
+    uint64_t offset_;
+    std::span<const std::byte> data_;
+  };
+
+  /// capacity is the size of the ring in bytes, a multiple of 16. The
+  /// storage is constructed with capacity and args.
+  template <typename... Args>
+  explicit ByteQueue(size_t capacity, Args&&... args)
+      : capacity_(CheckCapacity(capacity)),
+        storage_(std::forward<Args>(args)..., capacity),
+        control_(reinterpret_cast<ByteQueueControl*>(storage_.data())),
+        ring_(storage_.data() + hardwareInterferenceSize) {
+    static_assert(sizeof(ByteQueueControl) <= hardwareInterferenceSize,
+                  "control block must fit in a cache line");
+    if (control_->magic != ByteQueueControl::Magic) {
+      control_->capacity = capacity_;
+      control_->released.store(0, std::memory_order_relaxed);
+      storage_.persist(control_, sizeof(*control_));
+      control_->magic = ByteQueueControl::Magic;
+      storage_.persist(control_, sizeof(*control_));
+    } else if (control_->capacity != capacity_) {
+      throw std::invalid_argument("capacity does not match the storage");
+    }
+    released_ = head_ = tail_ = persisted_ = control_->released.load();
+  }
+
+  // non-copyable and non-movable
+  ByteQueue(const ByteQueue&) = delete;
+  ByteQueue& operator=(const ByteQueue&) = delete;
+
+  /// Largest payload that fits in the ring.
+  size_t max_size() const noexcept { return capacity_ - sizeof(Header); }
+
+  /// Enqueues a copy of data. Blocks while the ring is full.
+  void push(std::span<const std::byte> data) {
+    while (!try_push(data))
+      ;
+  }
+
+  /// Tries to enqueue a copy of data. Returns false if the ring is full.
+  bool try_push(std::span<const std::byte> data) {
+    if (data.size() > max_size()) {
+      throw std::length_error("record exceeds capacity");
+    }
+    auto const length = AlignUp(sizeof(Header) + data.size());
+    auto head = head_.load(std::memory_order_acquire);
+    for (;;) {
+      // A record never wraps, the end of the ring is reserved as padding
+      auto const room = capacity_ - head % capacity_;
+      auto const reserve = room < length ? room : length;
+      if (head + reserve - released_.load(std::memory_order_acquire) >
+          capacity_) {
+        if (AdvanceReleased())
+          continue;
+        auto const prevHead = head;
+        head = head_.load(std::memory_order_acquire);
+        if (head == prevHead)
+          return false;
+        continue;
+      }
+      if (!head_.compare_exchange_weak(head, head + reserve))
+        continue;
+      if (reserve == length) {
+        Reserve(head, static_cast<uint32_t>(length));
+        break;
+      }
+      Commit(head, 0, static_cast<uint32_t>(reserve), Padding);
+      Persisted(head, reserve);
+      // If the consumers have caught up, skip and release the padding here
+      // so that the space it frees does not wait for the next pop
+      auto tail = head;
+      if (tail_.compare_exchange_strong(tail, head + reserve))
+        Release(head);
+      head += reserve;
+    }
+    auto* payload = Payload(At(head));
+    std::memcpy(payload, data.data(), data.size());
+    storage_.flush(payload, data.size());
+    Commit(head, static_cast<uint32_t>(data.size()),
+           static_cast<uint32_t>(length), Committed);
+    return true;
+  }
+
+  /// Dequeues the next record. Blocks while the queue is empty.
+  ///
+  /// Do not block here while holding another Record: its space is not
+  /// reused until it is released, so once the other consumers have drained
+  /// the ring the producers cannot push the record waited for.
+  Record pop() noexcept {
+    for (;;) {
+      if (auto record = try_pop())
+        return std::move(*record);
+    }
+  }
+
+  /// Tries to dequeue the next record. Returns nothing if the queue is empty
+  /// or the next record is not committed yet.
+  std::optional<Record> try_pop() noexcept {
+    auto tail = tail_.load(std::memory_order_acquire);
+    for (;;) {
+      if (tail == head_.load(std::memory_order_acquire))
+        return std::nullopt;
+      auto* header = At(tail);
+      auto const state = header->state.load(std::memory_order_acquire);
+      if (state >> 2 != tail || (state & 3) == Empty)
+        return std::nullopt;
+      auto const length = header->length;
+      auto const size = header->size;
+      if (!tail_.compare_exchange_weak(tail, tail + length))
+        continue;
+      if ((state & 3) == Committed) {
+        return Record(this, tail, {Payload(header), size});
+      }
+      // Padding, or released before a crash
+      if ((state & 3) == Padding)
+        Release(tail);
+      tail += length;
+    }
+  }
+
+  /// Restores head_ and tail_ from the storage after a restart. Not thread
+  /// safe.
+  ///
+  /// The committed records that follow the released space are kept. A
+  /// record reserved but not committed before the crash becomes padding, the
+  /// records committed after it are kept as well.
+  void Recover() noexcept {
+    auto const released = control_->released.load();
+    auto end = released;
+    while (end - released < capacity_) {
+      auto* header = At(end);
+      auto const state = header->state.load(std::memory_order_relaxed);
+      auto const length = header->length;
+      if (state >> 2 != end || length == 0 ||
+          end + length - released > capacity_)
+        break;
+      if ((state & 3) == Empty) {
+        // Reserved by a push that did not return
+        header->size = 0;
+        header->state.store(end << 2 | Padding, std::memory_order_relaxed);
+      }
+      end += length;
+    }
+    // Clear what the lost records left behind in the free space
+    for (auto i = end; i < released + capacity_; i += Align)
+      At(i)->state.store(Empty, std::memory_order_relaxed);
+    storage_.persist(ring_, capacity_);
+    released_ = tail_ = released;
+    head_ = persisted_ = end;
+  }
+
+  /// Returns the number of bytes reserved and not yet consumed. Since this is
+  /// a concurrent queue this is only a best effort guess until all reader
+  /// and writer threads have been joined.
+  ptrdiff_t size() const noexcept {
+    return static_cast<ptrdiff_t>(head_.load(std::memory_order_relaxed) -
+                                  tail_.load(std::memory_order_relaxed));
+  }
+
+  bool empty() const noexcept { return size() <= 0; }
+
+private:
+  static size_t CheckCapacity(size_t capacity) {
+    if (capacity < 2 * sizeof(Header) || capacity % Align != 0) {
+      throw std::invalid_argument("capacity must be a multiple of 16");
+    }
+    return capacity;
+  }
+
+  static constexpr size_t AlignUp(size_t n) noexcept {
+    return (n + Align - 1) / Align * Align;
+  }
+
+  Header* At(uint64_t offset) const noexcept {
+    return reinterpret_cast<Header*>(ring_ + offset % capacity_);
+  }
+
+  static std::byte* Payload(Header* header) noexcept {
+    return reinterpret_cast<std::byte*>(header) + sizeof(Header);
+  }
+
+  void Commit(uint64_t offset, uint32_t size, uint32_t length, Kind kind) noexcept {
+    auto* header = At(offset);
+    header->size = size;
+    header->length = length;
+    storage_.flush(header, sizeof(Header));
+    storage_.drain();
+    header->state.store(offset << 2 | kind, std::memory_order_release);
+    storage_.persist(&header->state, sizeof(header->state));
+  }
+
+  // Persists the header of a record reserved at offset, still Empty, so that
+  // Recover() can step over the record if it is never committed
+  void Reserve(uint64_t offset, uint32_t length) noexcept {
+    if constexpr (Storage::Persistent) {
+      Commit(offset, 0, length, Empty);
+      Persisted(offset, length);
+    }
+  }
+
+  // Waits for the headers of the records reserved before offset to be
+  // durable, then marks the one reserved at offset durable as well. A push
+  // that returns has thus made every earlier reservation recoverable.
+  void Persisted(uint64_t offset, uint64_t length) noexcept {
+    if constexpr (Storage::Persistent) {
+      while (persisted_.load(std::memory_order_acquire) != offset)
+        ;
+      persisted_.store(offset + length, std::memory_order_release);
+    }
+  }
+
+  void Release(uint64_t offset) noexcept {
+    auto* header = At(offset);
+    header->state.store(offset << 2 | Released, std::memory_order_release);
+    storage_.persist(&header->state, sizeof(header->state));
+    AdvanceReleased();
+  }
+
+  // Moves released_ past the released records at its front. The thread that
+  // moves it past a record first clears every position a later header could
+  // occupy, so stale payload bytes are never taken for a header.
+  bool AdvanceReleased() noexcept {
+    bool advanced = false;
+    auto released = released_.load(std::memory_order_acquire);
+    for (;;) {
+      auto* header = At(released);
+      auto expected = released << 2 | Released;
+      auto const length = header->length;
+      if (!header->state.compare_exchange_strong(expected, Empty))
+        break;
+      for (size_t i = Align; i < length; i += Align)
+        At(released + i)->state.store(Empty, std::memory_order_relaxed);
+      storage_.flush(header, length);
+      released += length;
+      released_.store(released, std::memory_order_release);
+      advanced = true;
+    }
+    if (advanced) {
+      storage_.drain();
+      auto persisted = control_->released.load(std::memory_order_relaxed);
+      while (persisted < released &&
+             !control_->released.compare_exchange_weak(persisted, released,
+                                                       std::memory_order_relaxed))
+        ;
+      storage_.persist(&control_->released, sizeof(control_->released));
+    }
+    return advanced;
+  }
+
+  const size_t capacity_;
+  Storage storage_;
+  ByteQueueControl* control_;
+  std::byte* ring_;
+
+  // Align to avoid false sharing between head_, tail_, released_ and
+  // persisted_
+  alignas(hardwareInterferenceSize) std::atomic<uint64_t> head_;
+  alignas(hardwareInterferenceSize) std::atomic<uint64_t> tail_;
+  alignas(hardwareInterferenceSize) std::atomic<uint64_t> released_;
+  // End of the reservations whose headers are durable, with PmemByteStorage
+  alignas(hardwareInterferenceSize) std::atomic<uint64_t> persisted_;
+};
+
+using PmemByteQueue = ByteQueue<PmemByteStorage>;
+
+} // namespace mpmc
+} // namespace rigtorp
@@ -0,0 +1,283 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "ByteQueue.h"
+#include "MPMCQueue.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// Control block at the start of the log of a HybridQueue
+struct HybridLogControl {
+  static constexpr uint64_t Magic = 0x4d504d4348594252; // "MPMCHYBR"
+  uint64_t magic;
+  uint64_t capacity;
+  uint64_t recordSize;
+  // Tickets below it are consumed, persisted every batch pops
+  std::atomic<uint64_t> released;
+};
+
+/// Persistent queue that serves consumers from DRAM. Every push is written
+/// to a volatile ring like the one of Queue and to an append-only log in a
+/// file mapped with libpmem; pops only read the volatile ring and never
+/// touch persistent memory, except to persist how far the queue has been
+/// consumed once every batch pops.
+///
+/// The log has one record per slot, tagged with the ticket of the push. A
+/// producer writes it after it owns the volatile slot, so the record it
+/// overwrites has already been popped. Opening an existing log rebuilds the
+/// volatile ring from the records at or after the persisted watermark.
+///
+/// The watermark trails the pops by up to batch tickets, so after a crash up
+/// to batch items already popped, plus those popped by threads that were
+/// still running, are delivered again. A queue destroyed normally persists
+/// the exact watermark. T must be trivially copyable.
+template <typename T>
+class HybridQueue {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "T must be trivially copyable");
+
+  struct LogRecord {
+    std::atomic<uint64_t> seq; // ticket + 1, 0 if never written
+    T value;
+  };
+
+  struct Cell {
+    // Align to avoid false sharing between adjacent cells
+    alignas(hardwareInterferenceSize) std::atomic<size_t> turn = {0};
+    bool live = false; // false for tickets lost in a crash
+    alignas(T) std::byte value[sizeof(T)];
+  };
+
+public:
+  HybridQueue(size_t capacity, const std::string& logPath, size_t batch = 64)
+      : capacity_(CheckCapacity(capacity)), batch_(std::max<size_t>(batch, 1)),
+        storage_(logPath, capacity_ * sizeof(LogRecord)),
+        control_(reinterpret_cast<HybridLogControl*>(storage_.data())),
+        log_(reinterpret_cast<LogRecord*>(storage_.data() + hardwareInterferenceSize)),
+        // One extra cell to prevent false sharing on the last cell
+        cells_(new Cell[capacity_ + 1]) {
+    static_assert(sizeof(HybridLogControl) <= hardwareInterferenceSize,
+                  "control block must fit in a cache line");
+    if (control_->magic != HybridLogControl::Magic) {
+      std::memset(static_cast<void*>(log_), 0, capacity_ * sizeof(LogRecord));
+      storage_.persist(log_, capacity_ * sizeof(LogRecord));
+      control_->capacity = capacity_;
+      control_->recordSize = sizeof(LogRecord);
+      control_->released.store(0, std::memory_order_relaxed);
+      storage_.persist(control_, sizeof(*control_));
+      control_->magic = HybridLogControl::Magic;
+      storage_.persist(control_, sizeof(*control_));
+    } else if (control_->capacity != capacity_ ||
+               control_->recordSize != sizeof(LogRecord)) {
+      throw std::invalid_argument("capacity or type does not match the log");
+    } else {
+      Rebuild();
+    }
+  }
+
+  /// Persists the exact watermark, nothing else may use the queue
+  ~HybridQueue() noexcept {
+    PersistReleased(std::min(tail_.load(), head_.load()));
+  }
+
+  // non-copyable and non-movable
+  HybridQueue(const HybridQueue&) = delete;
+  HybridQueue& operator=(const HybridQueue&) = delete;
+
+  /// Enqueues v, durable once push() returns. Blocks while the queue is full.
+  void push(const T& v) noexcept {
+    auto const head = head_.fetch_add(1);
+    auto& cell = cells_[idx(head)];
+    while (turn(head) * 2 != cell.turn.load(std::memory_order_acquire))
+      ;
+    Append(head, cell, v);
+  }
+
+  /// Tries to enqueue v. Returns false if the queue is full.
+  bool try_push(const T& v) noexcept {
+    auto head = head_.load(std::memory_order_acquire);
+    for (;;) {
+      auto& cell = cells_[idx(head)];
+      if (turn(head) * 2 == cell.turn.load(std::memory_order_acquire)) {
+        if (head_.compare_exchange_strong(head, head + 1)) {
+          Append(head, cell, v);
+          return true;
+        }
+      } else {
+        auto const prevHead = head;
+        head = head_.load(std::memory_order_acquire);
+        if (head == prevHead)
+          return false;
+      }
+    }
+  }
+
+  /// Dequeues into v. Blocks while the queue is empty.
+  void pop(T& v) noexcept {
+    for (;;) {
+      auto const tail = tail_.fetch_add(1);
+      auto& cell = cells_[idx(tail)];
+      while (turn(tail) * 2 + 1 != cell.turn.load(std::memory_order_acquire))
+        ;
+      if (Take(tail, cell, v))
+        return;
+    }
+  }
+
+  /// Tries to dequeue into v. Returns false if the queue is empty.
+  bool try_pop(T& v) noexcept {
+    auto tail = tail_.load(std::memory_order_acquire);
+    for (;;) {
+      auto& cell = cells_[idx(tail)];
+      if (turn(tail) * 2 + 1 == cell.turn.load(std::memory_order_acquire)) {
+        if (tail_.compare_exchange_strong(tail, tail + 1)) {
+          if (Take(tail, cell, v))
+            return true;
+          tail = tail_.load(std::memory_order_acquire);
+        }
+      } else {
+        auto const prevTail = tail;
+        tail = tail_.load(std::memory_order_acquire);
+        if (tail == prevTail)
+          return false;
+      }
+    }
+  }
+
+  /// Returns the number of elements in the queue, counting the tickets lost
+  /// in a crash until they are skipped. Since this is a concurrent queue the
+  /// size is only a best effort guess until all reader and writer threads
+  /// have been joined.
+  ptrdiff_t size() const noexcept {
+    return static_cast<ptrdiff_t>(head_.load(std::memory_order_relaxed) -
+                                  tail_.load(std::memory_order_relaxed));
+  }
+
+  bool empty() const noexcept { return size() <= 0; }
+
+  size_t capacity() const noexcept { return capacity_; }
+
+private:
+  static size_t CheckCapacity(size_t capacity) {
+    if (capacity < 1)
+      throw std::invalid_argument("capacity < 1");
+    return capacity;
+  }
+
+  constexpr size_t idx(size_t i) const noexcept { return i % capacity_; }
+  constexpr size_t turn(size_t i) const noexcept { return i / capacity_; }
+
+  // Writes the log record of ticket head, then publishes the cell
+  void Append(size_t head, Cell& cell, const T& v) noexcept {
+    auto& record = log_[idx(head)];
+    std::memcpy(&record.value, &v, sizeof(T));
+    storage_.persist(&record.value, sizeof(T));
+    record.seq.store(head + 1, std::memory_order_relaxed);
+    storage_.persist(&record.seq, sizeof(record.seq));
+    std::memcpy(cell.value, &v, sizeof(T));
+    cell.live = true;
+    cell.turn.store(turn(head) * 2 + 1, std::memory_order_release);
+  }
+
+  // Consumes the cell of ticket tail, returns false for a lost ticket
+  bool Take(size_t tail, Cell& cell, T& v) noexcept {
+    auto const live = cell.live;
+    if (live)
+      std::memcpy(&v, cell.value, sizeof(T));
+    cell.turn.store(turn(tail) * 2 + 2, std::memory_order_release);
+    if ((tail + 1) % batch_ == 0)
+      AdvanceReleased(tail + 1);
+    return live;
+  }
+
+  // Moves the watermark over the consumed tickets before end. Pops complete
+  // out of order, so it stops at the first ticket still being consumed.
+  void AdvanceReleased(size_t end) noexcept {
+    auto t = control_->released.load(std::memory_order_acquire);
+    while (t < end && cells_[idx(t)].turn.load(std::memory_order_acquire) >=
+                          turn(t) * 2 + 2)
+      ++t;
+    PersistReleased(t);
+  }
+
+  void PersistReleased(uint64_t released) noexcept {
+    auto prev = control_->released.load(std::memory_order_relaxed);
+    while (prev < released &&
+           !control_->released.compare_exchange_weak(prev, released))
+      ;
+    storage_.persist(&control_->released, sizeof(control_->released));
+  }
+
+  // Restores the ring from the log records at or after the watermark. The
+  // newest capacity_ tickets are kept; a ticket without its record was taken
+  // by a producer that crashed and is skipped by the consumers.
+  void Rebuild() noexcept {
+    uint64_t released = control_->released.load();
+    uint64_t end = 0;
+    for (size_t i = 0; i < capacity_; ++i)
+      end = std::max<uint64_t>(end, log_[i].seq.load(std::memory_order_relaxed));
+    auto const tail = std::max(released, end > capacity_ ? end - capacity_ : 0);
+    auto const head = std::max(tail, end);
+    const auto ticketsBefore = [this](size_t ticket, size_t i) {
+      return ticket / capacity_ + (i < ticket % capacity_);
+    };
+    for (size_t i = 0; i < capacity_; ++i)
+      cells_[i].turn.store(ticketsBefore(head, i) + ticketsBefore(tail, i),
+                           std::memory_order_relaxed);
+    for (auto t = tail; t < head; ++t) {
+      auto& record = log_[idx(t)];
+      auto& cell = cells_[idx(t)];
+      cell.live = record.seq.load(std::memory_order_relaxed) == t + 1;
+      if (cell.live)
+        std::memcpy(cell.value, &record.value, sizeof(T));
+    }
+    PersistReleased(tail);
+    tail_ = tail;
+    head_ = head;
+  }
+
+  const size_t capacity_;
+  const size_t batch_;
+  PmemByteStorage storage_;
+  HybridLogControl* control_;
+  LogRecord* log_;
+  std::unique_ptr<Cell[]> cells_;
+
+  // Align to avoid false sharing between head_ and tail_
+  alignas(hardwareInterferenceSize) std::atomic<size_t> head_{0};
+  alignas(hardwareInterferenceSize) std::atomic<size_t> tail_{0};
+};
+} // namespace mpmc
+} // namespace rigtorp
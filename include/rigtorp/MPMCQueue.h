@@ -26,16 +26,21 @@ SOFTWARE.
 #include <atomic>
 #include <cassert>
 #include <cstddef> // offsetof
+#include <cstdint>
 #include <filesystem>
-#include <iostream>
+#include <functional> // std::hash
 #include <limits>
 #include <memory>
 #include <new> // std::hardware_destructive_interference_size
 #include <numeric>
 #include <span>
 #include <stdexcept>
+#include <thread>
 #include <tuple>
 
+#include <sched.h>  // sched_getcpu
+#include <unistd.h> // sysconf
+
 #ifndef __cpp_aligned_new
 #ifdef _WIN32
 #include <malloc.h> // _aligned_malloc
@@ -44,22 +49,60 @@ SOFTWARE.
 #endif
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>     // __get_cpuid
+#include <x86intrin.h> // __rdtsc, _mm_clwb
+#elif defined(MPMC_PERSIST_PROFILE)
+#include <chrono>
+#endif
+
 #include <libpmem.h>
 #include <libpmemobj++/make_persistent_array_atomic.hpp>
 #include <libpmemobj++/p.hpp>
 #include <libpmemobj++/persistent_ptr.hpp>
 #include <libpmemobj++/pool.hpp>
 
-namespace {
-// Toggle Memory Ordering Here
-constexpr auto LoadMemoryOrder = std::memory_order_acquire;
-constexpr auto StoreMemoryOrder = std::memory_order_release;
-// constexpr auto LoadMemoryOrder = std::memory_order_seq_cst;
-// constexpr auto StoreMemoryOrder = std::memory_order_seq_cst;
-} // namespace
+#include "Notifier.h"
 
 namespace rigtorp {
 namespace mpmc {
+
+/// Memory orders of the atomic operations of Queue, passed as its Ordering
+/// parameter. src/OrderingCheck.cpp explores every interleaving of small
+/// queues under a policy to check that it is strong enough.
+struct DefaultOrdering {
+  // fetch_add on head_ and tail_ in push() and pop()
+  static constexpr auto ticket = std::memory_order_seq_cst;
+  // Loads of head_ and tail_ and their compare_exchange in try_push() and
+  // try_pop()
+  static constexpr auto ticketLoad = std::memory_order_acquire;
+  static constexpr auto ticketCas = std::memory_order_seq_cst;
+  // Waiting for the turn of a slot and handing it over
+  static constexpr auto turnLoad = std::memory_order_acquire;
+  static constexpr auto turnStore = std::memory_order_release;
+};
+
+/// Every operation sequentially consistent.
+struct SeqCstOrdering {
+  static constexpr auto ticket = std::memory_order_seq_cst;
+  static constexpr auto ticketLoad = std::memory_order_seq_cst;
+  static constexpr auto ticketCas = std::memory_order_seq_cst;
+  static constexpr auto turnLoad = std::memory_order_seq_cst;
+  static constexpr auto turnStore = std::memory_order_seq_cst;
+};
+
+/// The weakest orders the queue is correct with. A ticket only has to be
+/// unique, which the atomicity of the read-modify-write guarantees; the
+/// payload is handed over by the release and acquire on the turn of its
+/// slot. Cheaper than DefaultOrdering where seq_cst read-modify-writes need
+/// extra fences, e.g. on ARM and POWER.
+struct RelaxedOrdering {
+  static constexpr auto ticket = std::memory_order_relaxed;
+  static constexpr auto ticketLoad = std::memory_order_relaxed;
+  static constexpr auto ticketCas = std::memory_order_relaxed;
+  static constexpr auto turnLoad = std::memory_order_acquire;
+  static constexpr auto turnStore = std::memory_order_release;
+};
 #if defined(__cpp_lib_hardware_interference_size) && !defined(__APPLE__)
 static constexpr size_t hardwareInterferenceSize =
     std::hardware_destructive_interference_size;
@@ -75,6 +118,10 @@ template <typename T>
 struct AlignedAllocator {
   using value_type = T;
 
+  AlignedAllocator() noexcept = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U>&) noexcept {}
+
   T* allocate(std::size_t n) {
     if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
       throw std::bad_array_new_length();
@@ -104,8 +151,22 @@ struct AlignedAllocator {
 };
 #endif
 
-template <typename T>
+/// Slots and the head and tail counters of a Queue are aligned to its
+/// Padding parameter, hardwareInterferenceSize by default. Where adjacent
+/// cache lines are fetched in pairs, as with the adjacent line prefetcher
+/// of Intel cpus, 128 keeps two slots or counters from sharing a pair, at
+/// the cost of more memory per slot. Padding must be a power of two no
+/// smaller than the turn of a slot.
+template <size_t Padding>
+constexpr bool validPadding() noexcept {
+  return Padding >= alignof(std::atomic<size_t>) &&
+         (Padding & (Padding - 1)) == 0;
+}
+
+template <typename T, size_t Padding = hardwareInterferenceSize>
 struct Slot {
+  static_assert(validPadding<Padding>(), "Padding must be a power of two");
+
   ~Slot() noexcept {
     if (turn & 1) {
       destroy();
@@ -130,36 +191,477 @@ struct Slot {
   }
 
   // Align to avoid false sharing between adjacent slots
-  alignas(hardwareInterferenceSize) std::atomic<size_t> turn = {0};
+  alignas(Padding) std::atomic<size_t> turn = {0};
   typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
 };
 
+template <typename T, typename Allocator, typename Ordering, size_t Padding>
+class Queue;
+
+/// Combines the concurrent ticket requests of threads on nearby cpus into
+/// one fetch_add on the queue's counter, see Queue::set_aggregator().
+///
+/// Threads on the cpus of a group meet in a funnel, one per group and
+/// counter. The first arrival after a batch is closed becomes the delegate
+/// of the next one: it takes tickets for everybody who has arrived at its
+/// funnel so far with a single fetch_add and hands them out in arrival
+/// order. The arrivals while a delegate waits for the counter form the next
+/// batch, so batches grow with contention and the counter's cache line only
+/// moves between one thread per group. A thread always gets a ticket taken
+/// after it arrived, so its own operations stay in order, as they do
+/// without aggregation. Without contention a ticket costs an extra
+/// read-modify-write on the funnel.
+///
+/// The funnels belong to the counters of one queue: an aggregator is
+/// attached to at most one queue at a time, set_aggregator() throws if it
+/// is already attached to another.
+class TicketAggregator {
+  static constexpr size_t kEntries = 256; // handed out tickets in flight
+
+  struct Entry {
+    std::atomic<uint64_t> tag{0}; // arrival index + 1 while the ticket waits
+    size_t ticket = 0;
+  };
+
+  struct Funnel {
+    alignas(hardwareInterferenceSize) std::atomic<uint64_t> arrivals{0};
+    // The arrival with this index is the delegate of the next batch
+    alignas(hardwareInterferenceSize) std::atomic<uint64_t> next{0};
+    alignas(hardwareInterferenceSize) Entry entries[kEntries];
+  };
+
+public:
+  /// Groups cpus by their number, cpusPerGroup consecutive cpus each.
+  explicit TicketAggregator(unsigned cpusPerGroup = 8)
+      : cpusPerGroup_(cpusPerGroup) {
+    if (cpusPerGroup_ < 1) {
+      throw std::invalid_argument("cpusPerGroup < 1");
+    }
+    auto const cpus = std::max(sysconf(_SC_NPROCESSORS_CONF), 1L);
+    groups_ = (static_cast<unsigned>(cpus) + cpusPerGroup_ - 1) / cpusPerGroup_;
+    funnels_.reset(new Funnel[groups_ * 2]);
+  }
+
+  // non-copyable and non-movable
+  TicketAggregator(const TicketAggregator&) = delete;
+  TicketAggregator& operator=(const TicketAggregator&) = delete;
+
+  unsigned cpus_per_group() const noexcept { return cpusPerGroup_; }
+
+  /// Returns true if the aggregator is attached to a queue.
+  bool attached() const noexcept {
+    return owner_.load(std::memory_order_relaxed) != nullptr;
+  }
+
+  /// Takes one ticket from counter, side 0 for head_ and 1 for tail_.
+  size_t take(std::atomic<size_t>& counter, unsigned side,
+              std::memory_order order) noexcept {
+    auto& f = funnels_[Group() * 2 + side];
+    auto const i = f.arrivals.fetch_add(1, std::memory_order_acq_rel);
+    for (;;) {
+      if (f.next.load(std::memory_order_acquire) == i) {
+        auto const end = f.arrivals.load(std::memory_order_acquire);
+        auto const base = counter.fetch_add(end - i, order);
+        for (auto j = i + 1; j < end; ++j) {
+          auto& e = f.entries[j % kEntries];
+          // Wait for the arrival kEntries before to pick up its ticket
+          while (e.tag.load(std::memory_order_acquire) != 0)
+            ;
+          e.ticket = base + (j - i);
+          e.tag.store(j + 1, std::memory_order_release);
+        }
+        f.next.store(end, std::memory_order_release);
+        return base;
+      }
+      auto& e = f.entries[i % kEntries];
+      if (e.tag.load(std::memory_order_acquire) == i + 1) {
+        auto const ticket = e.ticket;
+        e.tag.store(0, std::memory_order_release);
+        return ticket;
+      }
+    }
+  }
+
+private:
+  template <typename, typename, typename, size_t>
+  friend class Queue;
+
+  // Binds the aggregator to the counters of queue q
+  bool Attach(const void* q) noexcept {
+    const void* expected = nullptr;
+    return owner_.compare_exchange_strong(expected, q) || expected == q;
+  }
+
+  void Detach(const void* q) noexcept {
+    const void* expected = q;
+    owner_.compare_exchange_strong(expected, nullptr);
+  }
+
+  // The cpu is read once per thread, a thread that migrates keeps its
+  // funnel, which only costs locality
+  unsigned Group() const noexcept {
+    static thread_local int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : static_cast<unsigned>(cpu) / cpusPerGroup_ % groups_;
+  }
+
+  const unsigned cpusPerGroup_;
+  unsigned groups_;
+  std::unique_ptr<Funnel[]> funnels_;
+  std::atomic<const void*> owner_{nullptr}; // the queue attached, if any
+};
+
+/// Lets a push hand its item straight to a pop waiting on the same cell,
+/// without touching the ring, see Queue::set_elimination().
+///
+/// A pop that finds the volatile queue empty waits a bounded number of
+/// spins in a free cell before it takes a ticket; a push that finds the
+/// queue empty looks for such a waiting pop and fills its cell. Pairs only
+/// form while the queue looks empty, when the item would have been the next
+/// one popped anyway, but an item pushed to the ring at the same moment may
+/// be popped after the eliminated one: FIFO only holds between operations
+/// that do not overlap.
+template <typename T>
+class EliminationArray {
+  enum : uint32_t { kFree, kWaiting, kFilling, kFull };
+
+  struct Cell {
+    alignas(hardwareInterferenceSize) std::atomic<uint32_t> state{kFree};
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+public:
+  /// A pop waits up to spins iterations in one of cells cells.
+  explicit EliminationArray(size_t cells = 8, unsigned spins = 256)
+      : size_(cells), spins_(spins) {
+    if (size_ < 1) {
+      throw std::invalid_argument("cells < 1");
+    }
+    cells_.reset(new Cell[size_]);
+  }
+
+  // non-copyable and non-movable
+  EliminationArray(const EliminationArray&) = delete;
+  EliminationArray& operator=(const EliminationArray&) = delete;
+
+  size_t cells() const noexcept { return size_; }
+
+  /// Returns true if the array is attached to a queue.
+  bool attached() const noexcept {
+    return owner_.load(std::memory_order_relaxed) != nullptr;
+  }
+
+  /// Hands the item constructed from args to a waiting pop. Returns false,
+  /// leaving args alone, if no pop waits.
+  template <typename... Args>
+  bool give(Args&&... args) noexcept {
+    auto const start = Start();
+    for (size_t k = 0; k < size_; ++k) {
+      auto& c = cells_[(start + k) % size_];
+      uint32_t state = kWaiting;
+      if (c.state.load(std::memory_order_relaxed) != kWaiting ||
+          !c.state.compare_exchange_strong(state, kFilling,
+                                           std::memory_order_acquire))
+        continue;
+      new (&c.storage) T(std::forward<Args>(args)...);
+      c.state.store(kFull, std::memory_order_release);
+      return true;
+    }
+    return false;
+  }
+
+  /// Waits for a push to hand over an item. Returns false if none came.
+  bool take(T& v) noexcept {
+    auto& c = cells_[Start() % size_];
+    uint32_t state = kFree;
+    if (!c.state.compare_exchange_strong(state, kWaiting,
+                                         std::memory_order_relaxed))
+      return false;
+    for (unsigned i = 0; i < spins_; ++i) {
+      if (c.state.load(std::memory_order_acquire) == kFull)
+        return Take(c, v);
+    }
+    state = kWaiting;
+    if (c.state.compare_exchange_strong(state, kFree,
+                                        std::memory_order_relaxed))
+      return false;
+    // A push claimed the cell before the pop gave up
+    while (c.state.load(std::memory_order_acquire) != kFull)
+      ;
+    return Take(c, v);
+  }
+
+private:
+  template <typename, typename, typename, size_t>
+  friend class Queue;
+
+  // Binds the array to the pushes and pops of queue q
+  bool Attach(const void* q) noexcept {
+    const void* expected = nullptr;
+    return owner_.compare_exchange_strong(expected, q) || expected == q;
+  }
+
+  void Detach(const void* q) noexcept {
+    const void* expected = q;
+    owner_.compare_exchange_strong(expected, nullptr);
+  }
+
+  static bool Take(Cell& c, T& v) noexcept {
+    auto* p = reinterpret_cast<T*>(&c.storage);
+    v = std::move(*p);
+    p->~T();
+    c.state.store(kFree, std::memory_order_release);
+    return true;
+  }
+
+  // Spreads threads over the cells, every call moves on by one
+  static size_t Start() noexcept {
+    static thread_local size_t next =
+        std::hash<std::thread::id>()(std::this_thread::get_id());
+    return next++;
+  }
+
+  const size_t size_;
+  const unsigned spins_;
+  std::unique_ptr<Cell[]> cells_;
+  std::atomic<const void*> owner_{nullptr}; // the queue attached, if any
+};
+
+/// Time spent in each phase of the persistent operations of one kind, in TSC
+/// cycles (nanoseconds where there is no TSC).
+struct PersistOpProfile {
+  uint64_t ops = 0;
+  uint64_t waitCycles = 0;  // spinning for the slot's turn
+  uint64_t copyCycles = 0;  // constructing or moving the payload, storing turn
+  uint64_t flushCycles = 0; // writing back the slot's cache lines
+  uint64_t fenceCycles = 0; // draining the flushes
+  uint64_t bytesFlushed = 0;
+};
+
+struct PersistProfile {
+  PersistOpProfile push;
+  PersistOpProfile pop;
+};
+
+/// True when built with -DMPMC_PERSIST_PROFILE; otherwise persistProfile()
+/// stays zero and the persistent operations carry no profiling overhead.
+#ifdef MPMC_PERSIST_PROFILE
+static constexpr bool persistProfileEnabled = true;
+#else
+static constexpr bool persistProfileEnabled = false;
+#endif
+
+/// Per-thread breakdown of the persistent operations of the calling thread.
+inline PersistProfile& persistProfile() noexcept {
+  thread_local PersistProfile profile{};
+  return profile;
+}
+
+#ifdef MPMC_PERSIST_PROFILE
+class PersistTimer {
+public:
+  explicit PersistTimer(PersistOpProfile PersistProfile::*op) noexcept
+      : op_(persistProfile().*op), last_(now()) {
+    ++op_.ops;
+  }
+
+  void wait() noexcept { lap(op_.waitCycles); }
+  void copy() noexcept { lap(op_.copyCycles); }
+  void flush(size_t bytes) noexcept {
+    lap(op_.flushCycles);
+    op_.bytesFlushed += bytes;
+  }
+  void fence() noexcept { lap(op_.fenceCycles); }
+
+private:
+  static uint64_t now() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+  }
+
+  void lap(uint64_t& phase) noexcept {
+    auto const t = now();
+    phase += t - last_;
+    last_ = t;
+  }
+
+  PersistOpProfile& op_;
+  uint64_t last_;
+};
+#else
+class PersistTimer {
+public:
+  explicit PersistTimer(PersistOpProfile PersistProfile::*) noexcept {}
+  void wait() noexcept {}
+  void copy() noexcept {}
+  void flush(size_t) noexcept {}
+  void fence() noexcept {}
+};
+#endif
+
+/// How the persistent operations write a slot back to persistent memory.
+enum class FlushStrategy {
+  Auto,        // best instruction of the cpu, NonTemporal for large payloads
+  Pool,        // pmem::obj::pool::flush(), libpmem picks the instruction
+  Clwb,        // write back and keep the line cached
+  ClflushOpt,  // write back and evict, weakly ordered
+  Clflush,     // write back and evict, serializing
+  NonTemporal, // payload with non-temporal stores, turn with the best flush
+};
+
+inline const char* flushStrategyName(FlushStrategy s) noexcept {
+  switch (s) {
+  case FlushStrategy::Auto:
+    return "auto";
+  case FlushStrategy::Pool:
+    return "pool";
+  case FlushStrategy::Clwb:
+    return "clwb";
+  case FlushStrategy::ClflushOpt:
+    return "clflushopt";
+  case FlushStrategy::Clflush:
+    return "clflush";
+  case FlushStrategy::NonTemporal:
+    return "nt";
+  }
+  return "unknown";
+}
+
+/// Payloads of at least this many bytes are written with non-temporal stores
+/// under FlushStrategy::Auto, the threshold libpmem uses for its memcpy.
+static constexpr size_t nonTemporalThreshold = 256;
+
+#if defined(__x86_64__) || defined(__i386__)
+/// Returns true if the cpu implements the flush instruction of s.
+inline bool flushStrategySupported(FlushStrategy s) noexcept {
+  unsigned a, b, c, d;
+  switch (s) {
+  case FlushStrategy::Clwb:
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 24));
+  case FlushStrategy::ClflushOpt:
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 23));
+  case FlushStrategy::Clflush:
+    return __get_cpuid(1, &a, &b, &c, &d) && (d & (1u << 19));
+  default:
+    return true;
+  }
+}
+
+__attribute__((target("clwb"))) inline void
+clwbLines(const void* addr, size_t len) noexcept {
+  auto p = reinterpret_cast<uintptr_t>(addr) & ~(hardwareInterferenceSize - 1);
+  for (auto end = reinterpret_cast<uintptr_t>(addr) + len; p < end;
+       p += hardwareInterferenceSize)
+    _mm_clwb(reinterpret_cast<void*>(p));
+}
+
+__attribute__((target("clflushopt"))) inline void
+clflushoptLines(const void* addr, size_t len) noexcept {
+  auto p = reinterpret_cast<uintptr_t>(addr) & ~(hardwareInterferenceSize - 1);
+  for (auto end = reinterpret_cast<uintptr_t>(addr) + len; p < end;
+       p += hardwareInterferenceSize)
+    _mm_clflushopt(reinterpret_cast<void*>(p));
+}
+
+inline void clflushLines(const void* addr, size_t len) noexcept {
+  auto p = reinterpret_cast<uintptr_t>(addr) & ~(hardwareInterferenceSize - 1);
+  for (auto end = reinterpret_cast<uintptr_t>(addr) + len; p < end;
+       p += hardwareInterferenceSize)
+    _mm_clflush(reinterpret_cast<void*>(p));
+}
+#else
+inline bool flushStrategySupported(FlushStrategy s) noexcept {
+  return s == FlushStrategy::Auto || s == FlushStrategy::Pool ||
+         s == FlushStrategy::NonTemporal;
+}
+#endif
+
+/// Best flush instruction of the cpu, detected once.
+inline FlushStrategy detectFlushStrategy() noexcept {
+  static const FlushStrategy best = [] {
+    for (auto s : {FlushStrategy::Clwb, FlushStrategy::ClflushOpt,
+                   FlushStrategy::Clflush}) {
+      if (flushStrategySupported(s))
+        return s;
+    }
+    return FlushStrategy::Pool;
+  }();
+  return best;
+}
+
+/// Where the slots of a queue live.
+enum class Backend {
+  Volatile, // DRAM
+  PmemObj,  // a libpmemobj pool
+  PmemFile, // a file mapped with pmem_map_file, no libpmemobj
+};
+
+inline const char* backendName(Backend b) noexcept {
+  switch (b) {
+  case Backend::Volatile:
+    return "volatile";
+  case Backend::PmemObj:
+    return "pmemobj";
+  case Backend::PmemFile:
+    return "pmemfile";
+  }
+  return "unknown";
+}
+
+template <typename T, typename Codec>
+class ArenaQueue;
+class QueuePool;
 template <typename T>
+class Replicator;
+template <typename T, typename Q>
+class RelaxedQueue;
+
+template <typename T, size_t Padding = hardwareInterferenceSize>
 struct SimpleSlot {
+  static_assert(validPadding<Padding>(), "Padding must be a power of two");
+
   void construct(T val) { storage = val; }
   T move() const { return storage; }
 
   // Align to avoid false sharing between adjacent slots
-  alignas(hardwareInterferenceSize) std::atomic<size_t> turn = {0};
-  alignas(hardwareInterferenceSize) T storage{};
+  alignas(Padding) std::atomic<size_t> turn = {0};
+  alignas(Padding) T storage{};
 };
 
-template <typename T, typename Allocator = AlignedAllocator<Slot<T>>>
+/// Padding is the alignment of the slots and the distance between head_
+/// and tail_, see validPadding(). Allocator is rebound to the slot type of
+/// the padding.
+template <typename T, typename Allocator = AlignedAllocator<Slot<T>>,
+          typename Ordering = DefaultOrdering,
+          size_t Padding = hardwareInterferenceSize>
 class Queue {
+  using VolatileSlot = Slot<T, Padding>;
+  using SlotAllocator = typename std::allocator_traits<
+      Allocator>::template rebind_alloc<VolatileSlot>;
+
 public:
+  static constexpr size_t padding = Padding;
+
   struct VSlot {
     std::size_t turn{};
     T storage{};
     bool operator==(const VSlot&) const = default;
   };
   //   using PSlot = pmem::obj::p<Slot<T>>;
-  using PSlot = pmem::obj::p<SimpleSlot<T>>;
+  using PSlot = pmem::obj::p<SimpleSlot<T, Padding>>;
   using PSlotArray = PSlot[];
   using PSlotArrayPPtr = pmem::obj::persistent_ptr<PSlotArray>;
 
 private:
   struct Root {
     PSlotArrayPPtr pSlots_;
+    // Out of line payloads of ArenaQueue
+    pmem::obj::persistent_ptr<char[]> arena_;
+    // Set when the last user closed the pool, see keep_pool()
+    pmem::obj::p<bool> cleanShutdown_;
   };
   using RootPool = pmem::obj::pool<Root>;
   static_assert(std::is_nothrow_copy_assignable<T>::value ||
@@ -169,19 +671,6 @@ private:
   static_assert(std::is_nothrow_destructible<T>::value,
                 "T must be nothrow destructible");
 
-  auto CheckPmemSupport() -> bool {
-    const std::string tmpPath = poolPath_ + "_tmp";
-    std::size_t mappedLen;
-    int isPmem;
-    void* addr = pmem_map_file(tmpPath.data(), 1, PMEM_FILE_CREATE, 0666, &mappedLen, &isPmem);
-    assert(addr);
-    [[maybe_unused]] int error = pmem_unmap(addr, mappedLen);
-    assert(!error);
-    error = std::system(("rm " + tmpPath).data());
-    assert(!error);
-    return isPmem;
-  }
-
   auto RecoverValidatePre(std::span<const PSlot> slots) -> bool {
     bool preCondition;
     const auto [min, max] = std::ranges::minmax_element(slots, [](const auto& a, const auto& b) { return a.get_ro().turn < b.get_ro().turn; });
@@ -198,58 +687,68 @@ private:
     size_t head = std::accumulate(slots.begin(), firstZero, 0ULL, [](auto acc, const auto& slot) { return acc + (slot.get_ro().turn + 1) / 2; });
     return {tail, head};
   }
-  auto CalculateTailHead(std::span<const VSlot> slots) -> std::tuple<size_t, size_t> {
-    const auto firstZero = std::ranges::find_if(slots, [](const auto& a) { return a.turn == 0; });
-    size_t tail = std::accumulate(slots.begin(), firstZero, 0ULL, [](auto acc, const auto& slot) { return acc + slot.turn / 2; });
-    size_t head = std::accumulate(slots.begin(), firstZero, 0ULL, [](auto acc, const auto& slot) { return acc + (slot.turn + 1) / 2; });
-    return {tail, head};
-  }
-  auto GetVSlots(std::span<const PSlot> pSlots) -> std::vector<VSlot> {
-    std::vector<VSlot> vec{};
-    for (const auto& s : pSlots) {
-      vec.emplace_back(s.get_ro().turn.load(), *reinterpret_cast<const T*>(&(s.get_ro().storage)));
-    }
-    return vec;
-  }
-  auto GetPSlots(pmem::obj::pool_base pool, std::span<const VSlot> vSlots) -> std::span<PSlot> {
+  template <typename PersistFn>
+  auto GetPSlots(PSlot* out, std::span<const VSlot> vSlots, PersistFn persist) -> std::span<PSlot> {
     const auto sz = vSlots.size();
-    PSlotArrayPPtr pSlotArray{};
-    pmem::obj::make_persistent_atomic<PSlotArray>(pool, pSlotArray, sz + 1);
-    std::span<PSlot> pSlots{pSlotArray.get(), sz};
+    std::span<PSlot> pSlots{out, sz};
     for (auto i = 0u; i < sz; ++i) {
       auto& p = pSlots[i];
       auto& v = vSlots[i];
       p.get_rw().turn.store(v.turn);
       p.get_rw().construct(v.storage);
-      pool.persist(p);
+      persist(&p, sizeof(p));
     }
     return pSlots;
   }
 
+  // Rebuilds into a new array of a pool
   auto RecoverImpl(pmem::obj::pool_base pool, std::span<PSlot> pSlots) -> std::tuple<std::span<PSlot>, size_t, size_t> {
+    auto alloc = [&pool, sz = pSlots.size()] {
+      PSlotArrayPPtr pSlotArray{};
+      pmem::obj::make_persistent_atomic<PSlotArray>(pool, pSlotArray, sz + 1);
+      return pSlotArray.get();
+    };
+    return RecoverImpl(pSlots, alloc, [&pool](const void* addr, size_t len) { pool.persist(addr, len); });
+  }
+
+  // Returns pSlots if they are consistent, otherwise rebuilds them into the
+  // array returned by alloc()
+  template <typename AllocFn, typename PersistFn>
+  auto RecoverImpl(std::span<PSlot> pSlots, AllocFn alloc, PersistFn persist) -> std::tuple<std::span<PSlot>, size_t, size_t> {
     assert(!pSlots.empty());
-    assert(RecoverValidatePre(pSlots));
     bool isSorted = std::ranges::is_sorted(pSlots, [](const auto& a, const auto& b) { return a.get_ro().turn > b.get_ro().turn; });
-    if (isSorted) {
+    if (isSorted && RecoverValidatePre(pSlots)) {
       const auto [tail, head] = CalculateTailHead(pSlots);
       return {pSlots, tail, head};
     }
-    std::vector<VSlot> vSlots = GetVSlots(pSlots);
-    // find max turn and its last index
-    const auto lastMaxRIt = std::ranges::max_element(vSlots.rbegin(), vSlots.rend(), [](const auto& a, const auto& b) { return a.turn < b.turn; });
-    assert(lastMaxRIt != vSlots.rend());
-    const auto lastMaxIt = lastMaxRIt.base() - 1;
-    const auto maxTurn = lastMaxIt->turn;
-    if ((maxTurn % 2) == 0) {
-      // dequeues present, mark incomplete dequeues as complete and sort the rest of the enqueues
-      std::ranges::for_each(vSlots.begin(), lastMaxIt, [maxTurn](auto& a) { a.turn = maxTurn; });
-      std::ranges::stable_sort(lastMaxIt + 1, vSlots.end(), [](const auto& a, const auto& b) { return a.turn > b.turn; });
-    } else {
-      // only enqueues present, sort whole array
-      std::ranges::stable_sort(vSlots, [](const auto& a, const auto& b) { return a.turn > b.turn; });
+    // A thread preempted inside an operation can leave its slot several laps
+    // behind the others, so the slots are rebuilt from the tickets of the
+    // completed operations rather than by sorting the turns.
+    const auto cap = pSlots.size();
+    const auto ticketsBefore = [cap](size_t ticket, size_t i) { return ticket / cap + (i < ticket % cap); };
+    // Items before the last completed dequeue count as dequeued
+    size_t tail = 0;
+    for (auto i = 0u; i < cap; ++i) {
+      const auto turn = pSlots[i].get_ro().turn.load();
+      if (turn >= 2)
+        tail = std::max(tail, (turn / 2 - 1) * cap + i + 1);
     }
-    const auto [tail, head] = CalculateTailHead(std::span<const VSlot>{vSlots.begin(), vSlots.end()});
-    std::span<PSlot> newPSlots = GetPSlots(pool, vSlots);
+    std::vector<std::pair<size_t, T>> items{};
+    for (auto i = 0u; i < cap; ++i) {
+      const auto turn = pSlots[i].get_ro().turn.load();
+      const auto ticket = (turn - 1) / 2 * cap + i;
+      if (turn % 2 == 1 && ticket >= tail)
+        items.emplace_back(ticket, pSlots[i].get_ro().move());
+    }
+    std::ranges::sort(items, {}, [](const auto& item) { return item.first; });
+    // The remaining items keep their order at the tickets following tail
+    const size_t head = tail + items.size();
+    std::vector<VSlot> vSlots(cap);
+    for (auto i = 0u; i < cap; ++i)
+      vSlots[i].turn = ticketsBefore(head, i) + ticketsBefore(tail, i);
+    for (auto k = 0u; k < items.size(); ++k)
+      vSlots[(tail + k) % cap].storage = items[k].second;
+    std::span<PSlot> newPSlots = GetPSlots(alloc(), vSlots, persist);
     assert(RecoverValidatePost(newPSlots));
     return {newPSlots, tail, head};
   }
@@ -263,25 +762,25 @@ private:
     // Allocators are not required to honor alignment for over-aligned types
     // (see http://eel.is/c++draft/allocator.requirements#10) so we verify
     // alignment here
-    if (reinterpret_cast<size_t>(slots_) % alignof(Slot<T>) != 0) {
+    if (reinterpret_cast<size_t>(slots_) % alignof(VolatileSlot) != 0) {
       allocator_.deallocate(slots_, capacity_ + 1);
       throw std::bad_alloc();
     }
     for (size_t i = 0; i < capacity_; ++i) {
-      new (&slots_[i]) Slot<T>();
+      new (&slots_[i]) VolatileSlot();
     }
     static_assert(
-        alignof(Slot<T>) == hardwareInterferenceSize,
+        alignof(VolatileSlot) == Padding,
         "Slot must be aligned to cache line boundary to prevent false sharing");
-    static_assert(sizeof(Slot<T>) % hardwareInterferenceSize == 0,
+    static_assert(sizeof(VolatileSlot) % Padding == 0,
                   "Slot size must be a multiple of cache line size to prevent "
                   "false sharing between adjacent slots");
-    static_assert(sizeof(Queue) % hardwareInterferenceSize == 0,
+    static_assert(sizeof(Queue) % Padding == 0,
                   "Queue size must be a multiple of cache line size to "
                   "prevent false sharing between adjacent queues");
     static_assert(
         offsetof(Queue, tail_) - offsetof(Queue, head_) ==
-            static_cast<std::ptrdiff_t>(hardwareInterferenceSize),
+            static_cast<std::ptrdiff_t>(Padding),
         "head and tail must be a cache line apart to prevent false sharing");
   }
   void QueueDestroy() {
@@ -296,36 +795,36 @@ private:
     if (capacity_ < 1) {
       throw std::invalid_argument("capacity < 1");
     }
-    constexpr std::size_t POOL_SIZE = 1024ULL * 1024ULL * 1024ULL * 16; // 16Gb
+    if (backend_ == Backend::PmemFile) {
+      QueueInitFile();
+      return;
+    }
+    constexpr std::size_t MAX_POOL_SIZE = 1024ULL * 1024ULL * 1024ULL * 16; // 16Gb
     const std::size_t capacity_bytes = sizeof(PSlot) * (capacity_ + 1);
-    if (POOL_SIZE <= capacity_bytes) throw std::invalid_argument("capacity exceeds pool size");
+    // Recover() allocates the rebuilt slot array before freeing the old one
+    const std::size_t pool_size = 2 * capacity_bytes + arenaBytes_ + PMEMOBJ_MIN_POOL;
+    if (MAX_POOL_SIZE < pool_size) throw std::invalid_argument("capacity exceeds pool size");
     const auto layout = std::filesystem::path{poolPath_}.filename().string();
+    RootPool pool;
     if (std::filesystem::exists(poolPath_) == false) {
-      pop_ = RootPool::create(poolPath_, layout, POOL_SIZE);
-      pop_.close();
-    }
-    int checkPool = RootPool::check(poolPath_, layout);
-    if (checkPool == 0) {
-      assert(false && "Error: poolfile is in inconsistent state");
-      throw std::runtime_error("poolfile is in inconsistent state");
-    }
-    pop_ = RootPool::open(poolPath_, layout);
-    auto& rootPSlots = pop_.root()->pSlots_;
-    if (rootPSlots == nullptr) {
-      // Allocate one extra slot to prevent false sharing on the last slot
-      pmem::obj::make_persistent_atomic<PSlotArray>(pop_, rootPSlots, capacity_ + 1);
-      pop_.root().persist();
-      // TODO: Make sure each pSlot is aligned. Honor the guarantees of the non-persistent constructor
-      /*     if (reinterpret_cast<size_t>(slots_) % alignof(Slot<T>) != 0) {
-            allocator_.deallocate(slots_, capacity_ + 1);
-            throw std::bad_alloc();
-          }
-          for (size_t i = 0; i < capacity_; ++i) {
-            new (&slots_[i]) Slot<T>();
-          } */
+      pool = RootPool::create(poolPath_, layout, pool_size);
+    } else {
+      pool = RootPool::open(poolPath_, layout);
+      if (!pool.root()->cleanShutdown_) {
+        // The last user crashed or predates the flag, run the full check
+        pool.close();
+        int checkPool = RootPool::check(poolPath_, layout);
+        if (checkPool == 0) {
+          assert(false && "Error: poolfile is in inconsistent state");
+          throw std::runtime_error("poolfile is in inconsistent state");
+        }
+        pool = RootPool::open(poolPath_, layout);
+      }
     }
-    pSlots_ = rootPSlots.get();
-    std::cout << "MPMC Persistent Memory Support: " << CheckPmemSupport() << "\n";
+    pop_ = pool;
+    root_ = pool.root();
+    SetCleanShutdown(false);
+    QueueAttachRoot();
 
     // std::cout << "PSlot size: " << sizeof(PSlot) << "\n";
     // std::cout << "Queue size: " << sizeof(Queue) << "\n";
@@ -336,39 +835,153 @@ private:
 
     // TODO: Make sure each pSlot is aligned. Honor the guarantees of the non-persistent constructor
     static_assert(
-        alignof(PSlot) == hardwareInterferenceSize,
+        alignof(PSlot) == Padding,
         "Slot must be aligned to cache line boundary to prevent false sharing");
-    static_assert(sizeof(PSlot) % hardwareInterferenceSize == 0,
+    static_assert(sizeof(PSlot) % Padding == 0,
                   "Slot size must be a multiple of cache line size to prevent "
                   "false sharing between adjacent slots");
-    static_assert(sizeof(Queue) % hardwareInterferenceSize == 0,
+    static_assert(sizeof(Queue) % Padding == 0,
                   "Queue size must be a multiple of cache line size to "
                   "prevent false sharing between adjacent queues");
     static_assert(
         offsetof(Queue, tail_) - offsetof(Queue, head_) ==
-            static_cast<std::ptrdiff_t>(hardwareInterferenceSize),
+            static_cast<std::ptrdiff_t>(Padding),
         "head and tail must be a cache line apart to prevent false sharing");
   }
 
+  // Allocates what root_ is missing and maps the slots
+  void QueueAttachRoot() {
+    auto& rootPSlots = root_->pSlots_;
+    if (rootPSlots == nullptr) {
+      // Allocate one extra slot to prevent false sharing on the last slot
+      pmem::obj::make_persistent_atomic<PSlotArray>(pop_, rootPSlots, capacity_ + 1);
+      root_.persist();
+      // TODO: Make sure each pSlot is aligned. Honor the guarantees of the non-persistent constructor
+      /*     if (reinterpret_cast<size_t>(slots_) % alignof(Slot<T>) != 0) {
+            allocator_.deallocate(slots_, capacity_ + 1);
+            throw std::bad_alloc();
+          }
+          for (size_t i = 0; i < capacity_; ++i) {
+            new (&slots_[i]) Slot<T>();
+          } */
+    }
+    pSlots_ = rootPSlots.get();
+    auto& rootArena = root_->arena_;
+    if (arenaBytes_ > 0 && rootArena == nullptr) {
+      pmem::obj::make_persistent_atomic<char[]>(pop_, rootArena, arenaBytes_);
+      root_.persist();
+    }
+    isPmem_ = pmem_is_pmem(pSlots_, sizeof(PSlot) * (capacity_ + 1)) != 0;
+    set_flush_strategy(FlushStrategy::Auto);
+  }
+
+  void QueueInitFile() {
+    if (arenaBytes_ > 0)
+      throw std::invalid_argument("the arena needs the pmemobj backend");
+    const std::size_t len = fileHeaderSize + 2 * sizeof(PSlot) * (capacity_ + 1);
+    // An existing file is mapped whole, PMEM_FILE_CREATE would resize it
+    // before the header is checked. Only a file created here is initialized,
+    // PMEM_FILE_EXCL fails if another one appeared meanwhile.
+    const bool exists = std::filesystem::exists(poolPath_);
+    int isPmem;
+    void* addr = pmem_map_file(poolPath_.c_str(), exists ? 0 : len,
+                               exists ? 0 : PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0666, &fileLen_, &isPmem);
+    if (addr == nullptr)
+      throw std::runtime_error(std::string("pmem_map_file: ") + pmem_errormsg());
+    file_ = static_cast<FileHeader*>(addr);
+    isPmem_ = isPmem != 0;
+    // A file that is too short, or that was not made by a queue, is never
+    // written to. That includes one whose creation crashed before the magic
+    // was persisted, it has to be removed.
+    if (fileLen_ < len || (exists && file_->magic != FileHeader::Magic)) {
+      pmem_unmap(file_, fileLen_);
+      file_ = nullptr;
+      throw std::invalid_argument("pool file is not a queue file of this capacity");
+    }
+    if (file_->magic != FileHeader::Magic) {
+      // A new file is zero filled, so every turn starts at 0
+      file_->capacity = capacity_;
+      file_->slotSize = sizeof(PSlot);
+      file_->active = 0;
+      Persist(file_, sizeof(*file_));
+      file_->magic = FileHeader::Magic;
+      Persist(&file_->magic, sizeof(file_->magic));
+    } else if (file_->capacity != capacity_ || file_->slotSize != sizeof(PSlot)) {
+      pmem_unmap(file_, fileLen_);
+      file_ = nullptr;
+      throw std::invalid_argument("pool file does not match the queue");
+    }
+    pSlots_ = FileSlots(file_->active);
+    set_flush_strategy(FlushStrategy::Auto);
+  }
+
+  void QueueDestroyFile() {
+    pmem_unmap(file_, fileLen_);
+    file_ = nullptr;
+    if (!keepPool_)
+      std::filesystem::remove(poolPath_);
+  }
+
+  void SetCleanShutdown(bool clean) {
+    auto& flag = root_->cleanShutdown_;
+    flag = clean;
+    pop_.persist(flag);
+  }
+
+  // Slot array a, 0 or 1, of a PmemFile queue
+  PSlot* FileSlots(uint64_t a) const noexcept {
+    return reinterpret_cast<PSlot*>(reinterpret_cast<char*>(file_) + fileHeaderSize) +
+           a * (capacity_ + 1);
+  }
+
   void QueueDestroyPersistent() {
-    auto& rootPSlots = pop_.root()->pSlots_;
+    if (backend_ == Backend::PmemFile) {
+      QueueDestroyFile();
+      return;
+    }
+    // A QueuePool owns the pool and the queue stays in it
+    if (!ownsPool_)
+      return;
+    if (keepPool_) {
+      SetCleanShutdown(true);
+      pop_.close();
+      return;
+    }
+    auto& rootPSlots = root_->pSlots_;
     pmem::obj::delete_persistent_atomic<PSlotArray>(rootPSlots, capacity_ + 1);
     rootPSlots = nullptr;
-    pop_.root().persist();
+    auto& rootArena = root_->arena_;
+    if (rootArena != nullptr) {
+      pmem::obj::delete_persistent_atomic<char[]>(rootArena, arenaBytes_);
+      rootArena = nullptr;
+    }
+    root_.persist();
     pop_.close();
-    int err = std::system(("rm -f " + poolPath_).data());
-    if (err) throw std::runtime_error("error on pool deletion");
+    std::filesystem::remove(poolPath_);
   }
 
 public:
-  explicit Queue(size_t capacity, bool isPersistent, std::string poolPath = {}, const Allocator& allocator = Allocator())
-      : capacity_(capacity), isPersistent_(isPersistent), poolPath_(poolPath), allocator_(allocator), head_(0), tail_(0) {
+  /// arenaBytes reserves room in the pool for the payloads of an ArenaQueue.
+  explicit Queue(size_t capacity, bool isPersistent, std::string poolPath = {}, const Allocator& allocator = Allocator(),
+                 size_t arenaBytes = 0)
+      : Queue(capacity, isPersistent ? Backend::PmemObj : Backend::Volatile, std::move(poolPath), allocator,
+              arenaBytes) {}
+
+  /// Backend::PmemFile keeps the slots in poolPath mapped with pmem_map_file
+  /// instead of a libpmemobj pool; the arena of an ArenaQueue needs PmemObj.
+  explicit Queue(size_t capacity, Backend backend, std::string poolPath = {}, const Allocator& allocator = Allocator(),
+                 size_t arenaBytes = 0)
+      : capacity_(capacity), isPersistent_(backend != Backend::Volatile), backend_(backend),
+        poolPath_(std::move(poolPath)), arenaBytes_(arenaBytes), allocator_(allocator), head_(0), tail_(0) {
     if (isPersistent_) QueueInitPersistent();
     else
       QueueInit();
   }
 
   ~Queue() noexcept {
+    if (aggregator_ != nullptr) aggregator_->Detach(this);
+    if (elimination_ != nullptr) elimination_->Detach(this);
+    if (sweeper_.joinable()) sweeper_.join();
     if (isPersistent_) QueueDestroyPersistent();
     else
       QueueDestroy();
@@ -380,11 +993,17 @@ public:
 
   auto Recover() -> void {
     assert(isPersistent_);
-    auto [span, t, h] = RecoverImpl(pop_, std::span<PSlot>{pop_.root()->pSlots_.get(), capacity_});
-    auto& rootPSlots = pop_.root()->pSlots_;
+    WaitRecovered();
+    lazyTail_ = lazyHead_ = lazyLimit_ = 0;
+    if (backend_ == Backend::PmemFile) {
+      RecoverFile();
+      return;
+    }
+    auto [span, t, h] = RecoverImpl(pop_, std::span<PSlot>{root_->pSlots_.get(), capacity_});
+    auto& rootPSlots = root_->pSlots_;
     auto prev = rootPSlots;
     rootPSlots = span.data();
-    pop_.root().persist();
+    root_.persist();
     pSlots_ = rootPSlots.get();
     tail_ = t;
     head_ = h;
@@ -393,17 +1012,125 @@ public:
       pmem::obj::delete_persistent_atomic<PSlotArray>(prev, capacity_ + 1);
   }
 
+  /// Recovers a PmemFile queue. The slots are rebuilt into the inactive
+  /// array of the file, which only becomes active once it is persisted.
+  auto RecoverFile() -> void {
+    auto const inactive = 1 - file_->active;
+    auto [span, t, h] = RecoverImpl(
+        std::span<PSlot>{pSlots_, capacity_}, [this, inactive] { return FileSlots(inactive); },
+        [this](const void* addr, size_t len) { Persist(addr, len); });
+    if (span.data() != pSlots_) {
+      file_->active = inactive;
+      Persist(&file_->active, sizeof(file_->active));
+      pSlots_ = span.data();
+    }
+    tail_ = t;
+    head_ = h;
+  }
+
+  /// Recovers the queue in O(log capacity + maxThreads) so it can serve
+  /// operations at once, instead of rebuilding the slot array like Recover().
+  ///
+  /// Slot turns are only out of order around the tickets that were in flight
+  /// at the crash, at most one per thread, so head_ and tail_ are found by a
+  /// binary search followed by a scan past the last completed enqueue and
+  /// dequeue. maxThreads bounds the number of threads that used the queue.
+  /// Tickets in flight further back are repaired by the first operation that
+  /// reaches their slot: consumers skip holes and slots already dequeued, and
+  /// items behind tail_ count as dequeued, as they do for Recover(). A
+  /// background thread sweeps the remaining slots; WaitRecovered() waits for
+  /// it.
+  ///
+  /// size() includes the holes until the consumers have skipped them. Not
+  /// thread safe, like Recover().
+  auto RecoverLazy(size_t maxThreads = 1024) -> void {
+    assert(isPersistent_);
+    WaitRecovered();
+    auto const turnAt = [this](size_t ticket) {
+      return pSlots_[idx(ticket)].get_ro().turn.load(std::memory_order_relaxed);
+    };
+    // Ticket after the completed operation of the last slot that has done as
+    // many operations of one kind as slot 0
+    auto const boundary = [this, &turnAt](auto ops) -> size_t {
+      auto const ops0 = ops(turnAt(0));
+      size_t lo = 1, hi = capacity_;
+      while (lo < hi) {
+        auto const mid = lo + (hi - lo) / 2;
+        if (ops(turnAt(mid)) == ops0)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return ops0 == 0 ? 0 : (ops0 - 1) * capacity_ + lo;
+    };
+    // Ticket after the last completed operation from ticket on; every
+    // operation missing before it was in flight
+    auto const scan = [this, &turnAt, maxThreads](size_t ticket, size_t parity) {
+      auto end = ticket;
+      for (size_t missing = 0; missing <= maxThreads; ++ticket) {
+        if (turnAt(ticket) > turn(ticket) * 2 + parity)
+          end = ticket + 1;
+        else
+          ++missing;
+      }
+      return end;
+    };
+    lazyHead_ = scan(boundary([](size_t t) { return (t + 1) / 2; }), 0);
+    lazyTail_ = std::min(lazyHead_, scan(boundary([](size_t t) { return t / 2; }), 1));
+    // Producers one lap ahead may find holes and items behind tail_
+    lazyLimit_ = lazyHead_ + capacity_;
+    head_ = lazyHead_;
+    tail_ = lazyTail_;
+    sweeper_ = std::thread([this] {
+      for (size_t i = 0; i < capacity_; ++i)
+        LazyResolve(i);
+    });
+  }
+
+  /// Waits for the background sweep started by RecoverLazy() to finish.
+  auto WaitRecovered() -> void {
+    if (sweeper_.joinable()) sweeper_.join();
+  }
+
   template <typename... Args>
   void emplace_p(Args&&... args) noexcept {
     static_assert(std::is_nothrow_constructible<T, Args&&...>::value,
                   "T must be nothrow constructible with Args&&...");
-    auto const head = head_.fetch_add(1);
+    auto head = TakeTicket(head_, 0);
+    PersistTimer timer{&PersistProfile::push};
+    while (head < lazyLimit_ && !LazyWait(head, 0))
+      head = TakeTicket(head_, 0);
+    PrefetchAhead(pSlots_, head + prefetchDistance_);
     PSlot& slot = pSlots_[idx(head)];
-    while (turn(head) * 2 != slot.get_ro().turn.load(LoadMemoryOrder))
+    while (turn(head) * 2 != slot.get_ro().turn.load(Ordering::turnLoad))
       ;
-    slot.get_rw().construct(std::forward<Args>(args)...);
-    slot.get_rw().turn.store(turn(head) * 2 + 1, StoreMemoryOrder);
-    pop_.persist(slot);
+    timer.wait();
+    auto& s = slot.get_rw();
+    bool nonTemporal = false;
+    if constexpr (std::is_trivially_copyable<T>::value) {
+      if (ntPayload_) {
+        const T v(std::forward<Args>(args)...);
+        pmem_memcpy(&s.storage, &v, sizeof(T),
+                    PMEM_F_MEM_NONTEMPORAL | PMEM_F_MEM_NODRAIN);
+        // Non-temporal stores are weakly ordered, the payload must reach
+        // memory before a consumer or a crash can see the turn
+        pmem_drain();
+        nonTemporal = true;
+      }
+    }
+    if (!nonTemporal)
+      s.construct(std::forward<Args>(args)...);
+    s.turn.store(turn(head) * 2 + 1, Ordering::turnStore);
+    timer.copy();
+    // Only the lines that were written, the payload lines are already on
+    // their way to memory after non-temporal stores
+    FlushLines(&s.turn, sizeof(s.turn));
+    if (!nonTemporal)
+      FlushLines(&s.storage, sizeof(s.storage));
+    timer.flush(nonTemporal ? sizeof(s.turn) : sizeof(s.turn) + sizeof(s.storage));
+    Drain();
+    timer.fence();
+    Notify();
   }
 
   void pop(T& v) noexcept {
@@ -414,45 +1141,63 @@ public:
   }
 
   void pop_p(T& v) noexcept {
-    auto const tail = tail_.fetch_add(1);
+    auto tail = TakeTicket(tail_, 1);
+    PersistTimer timer{&PersistProfile::pop};
+    while (tail < lazyLimit_ && !LazyWait(tail, 1))
+      tail = TakeTicket(tail_, 1);
+    PrefetchAhead(pSlots_, tail + prefetchDistance_);
     PSlot& slot = pSlots_[idx(tail)];
-    while (turn(tail) * 2 + 1 != slot.get_ro().turn.load(LoadMemoryOrder))
+    while (turn(tail) * 2 + 1 != slot.get_ro().turn.load(Ordering::turnLoad))
       ;
+    timer.wait();
     // v = slot.move();
     // slot.destroy();
     v = slot.get_rw().move();
-    slot.get_rw().turn.store(turn(tail) * 2 + 2, StoreMemoryOrder);
-    pop_.persist(slot);
+    auto& turnRef = slot.get_rw().turn;
+    turnRef.store(turn(tail) * 2 + 2, Ordering::turnStore);
+    timer.copy();
+    // The payload is only read, write back the turn alone
+    FlushLines(&turnRef, sizeof(turnRef));
+    timer.flush(sizeof(turnRef));
+    Drain();
+    timer.fence();
   }
 
   template <typename... Args>
   void emplace_v(Args&&... args) noexcept {
     static_assert(std::is_nothrow_constructible<T, Args&&...>::value,
                   "T must be nothrow constructible with Args&&...");
-    auto const head = head_.fetch_add(1);
+    if (elimination_ != nullptr && empty() &&
+        elimination_->give(std::forward<Args>(args)...))
+      return;
+    auto const head = TakeTicket(head_, 0);
+    PrefetchAhead(slots_, head + prefetchDistance_);
     auto& slot = slots_[idx(head)];
-    while (turn(head) * 2 != slot.turn.load(LoadMemoryOrder))
+    while (turn(head) * 2 != slot.turn.load(Ordering::turnLoad))
       ;
     slot.construct(std::forward<Args>(args)...);
-    slot.turn.store(turn(head) * 2 + 1, std::memory_order_release);
+    slot.turn.store(turn(head) * 2 + 1, Ordering::turnStore);
+    Notify();
   }
 
   template <typename... Args>
   bool try_emplace(Args&&... args) noexcept {
     static_assert(std::is_nothrow_constructible<T, Args&&...>::value,
                   "T must be nothrow constructible with Args&&...");
-    auto head = head_.load(std::memory_order_acquire);
+    auto head = head_.load(Ordering::ticketLoad);
     for (;;) {
       auto& slot = slots_[idx(head)];
-      if (turn(head) * 2 == slot.turn.load(LoadMemoryOrder)) {
-        if (head_.compare_exchange_strong(head, head + 1)) {
+      if (turn(head) * 2 == slot.turn.load(Ordering::turnLoad)) {
+        if (head_.compare_exchange_strong(head, head + 1, Ordering::ticketCas,
+                                        std::memory_order_relaxed)) {
           slot.construct(std::forward<Args>(args)...);
-          slot.turn.store(turn(head) * 2 + 1, std::memory_order_release);
+          slot.turn.store(turn(head) * 2 + 1, Ordering::turnStore);
+          Notify();
           return true;
         }
       } else {
         auto const prevHead = head;
-        head = head_.load(std::memory_order_acquire);
+        head = head_.load(Ordering::ticketLoad);
         if (head == prevHead) {
           return false;
         }
@@ -513,29 +1258,33 @@ public:
   }
 
   void pop_v(T& v) noexcept {
-    auto const tail = tail_.fetch_add(1);
+    if (elimination_ != nullptr && empty() && elimination_->take(v))
+      return;
+    auto const tail = TakeTicket(tail_, 1);
+    PrefetchAhead(slots_, tail + prefetchDistance_);
     auto& slot = slots_[idx(tail)];
-    while (turn(tail) * 2 + 1 != slot.turn.load(LoadMemoryOrder))
+    while (turn(tail) * 2 + 1 != slot.turn.load(Ordering::turnLoad))
       ;
     v = slot.move();
     slot.destroy();
-    slot.turn.store(turn(tail) * 2 + 2, std::memory_order_release);
+    slot.turn.store(turn(tail) * 2 + 2, Ordering::turnStore);
   }
 
   bool try_pop(T& v) noexcept {
-    auto tail = tail_.load(std::memory_order_acquire);
+    auto tail = tail_.load(Ordering::ticketLoad);
     for (;;) {
       auto& slot = slots_[idx(tail)];
-      if (turn(tail) * 2 + 1 == slot.turn.load(std::memory_order_acquire)) {
-        if (tail_.compare_exchange_strong(tail, tail + 1)) {
+      if (turn(tail) * 2 + 1 == slot.turn.load(Ordering::turnLoad)) {
+        if (tail_.compare_exchange_strong(tail, tail + 1, Ordering::ticketCas,
+                                        std::memory_order_relaxed)) {
           v = slot.move();
           slot.destroy();
-          slot.turn.store(turn(tail) * 2 + 2, std::memory_order_release);
+          slot.turn.store(turn(tail) * 2 + 2, Ordering::turnStore);
           return true;
         }
       } else {
         auto const prevTail = tail;
-        tail = tail_.load(std::memory_order_acquire);
+        tail = tail_.load(Ordering::ticketLoad);
         if (tail == prevTail) {
           return false;
         }
@@ -543,6 +1292,81 @@ public:
     }
   }
 
+  /// Pushes the n items with one ticket increment to consecutive slots, so
+  /// no other item lands between them. With a prefetch distance the slots
+  /// are prefetched ahead of the one being filled. The persistent queue
+  /// pushes them one by one.
+  void push_batch(const T* items, size_t n) noexcept {
+    static_assert(std::is_nothrow_copy_constructible<T>::value,
+                  "T must be nothrow copy constructible");
+    if (isPersistent_) {
+      for (size_t k = 0; k < n; ++k)
+        push_p(items[k]);
+      return;
+    }
+    if (n == 0)
+      return;
+    auto const head = head_.fetch_add(n, Ordering::ticket);
+    PrefetchOwn(head, std::min(n, prefetchDistance_));
+    for (size_t k = 0; k < n; ++k) {
+      if (prefetchDistance_ != 0 && k + prefetchDistance_ < n)
+        PrefetchOwn(head + k + prefetchDistance_, 1);
+      auto& slot = slots_[idx(head + k)];
+      while (turn(head + k) * 2 != slot.turn.load(Ordering::turnLoad))
+        ;
+      slot.construct(items[k]);
+      slot.turn.store(turn(head + k) * 2 + 1, Ordering::turnStore);
+    }
+    Notify();
+  }
+
+  /// Pops n consecutive items with one ticket increment, waiting for each.
+  /// The persistent queue pops them one by one.
+  void pop_batch(T* out, size_t n) noexcept {
+    if (isPersistent_) {
+      for (size_t k = 0; k < n; ++k)
+        pop_p(out[k]);
+      return;
+    }
+    if (n == 0)
+      return;
+    auto const tail = tail_.fetch_add(n, Ordering::ticket);
+    PrefetchOwn(tail, std::min(n, prefetchDistance_));
+    for (size_t k = 0; k < n; ++k) {
+      if (prefetchDistance_ != 0 && k + prefetchDistance_ < n)
+        PrefetchOwn(tail + k + prefetchDistance_, 1);
+      auto& slot = slots_[idx(tail + k)];
+      while (turn(tail + k) * 2 + 1 != slot.turn.load(Ordering::turnLoad))
+        ;
+      out[k] = slot.move();
+      slot.destroy();
+      slot.turn.store(turn(tail + k) * 2 + 2, Ordering::turnStore);
+    }
+  }
+
+  /// Returns the queue to its initial empty state so it can be reused, e.g.
+  /// between benchmark runs. Not thread safe: all reader and writer threads
+  /// must be quiescent.
+  void reset() noexcept {
+    if (isPersistent_) {
+      if (sweeper_.joinable()) sweeper_.join();
+      lazyTail_ = lazyHead_ = lazyLimit_ = 0;
+      for (size_t i = 0; i < capacity_; ++i) {
+        pSlots_[i].get_rw().turn.store(0, std::memory_order_relaxed);
+      }
+      Persist(pSlots_, sizeof(PSlot) * capacity_);
+    } else {
+      for (size_t i = 0; i < capacity_; ++i) {
+        if (slots_[i].turn.load(std::memory_order_relaxed) & 1) {
+          slots_[i].destroy();
+        }
+        slots_[i].turn.store(0, std::memory_order_relaxed);
+      }
+    }
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+  }
+
   /// Returns the number of elements in the queue.
   /// The size can be negative when the queue is empty and there is at least one
   /// reader waiting. Since this is a concurrent queue the size is only a best
@@ -558,26 +1382,303 @@ public:
   /// until all reader and writer threads have been joined.
   bool empty() const noexcept { return size() <= 0; }
 
+  bool is_persistent() const noexcept { return isPersistent_; }
+
+  Backend backend() const noexcept { return backend_; }
+
+  /// Returns true if the slots are on persistent memory rather than a file
+  /// system without DAX, as detected when the pool was opened.
+  bool is_pmem() const noexcept { return isPmem_; }
+
+  /// By default the pool is deleted with the queue. With keep set it is
+  /// kept and marked as cleanly shut down, so the next open skips the full
+  /// consistency check of libpmemobj.
+  void keep_pool(bool keep) noexcept { keepPool_ = keep; }
+
+  /// Wakes the consumers sleeping on n after every push, nullptr detaches
+  /// it. Not thread safe, set it before the queue is shared.
+  void set_notifier(Notifier* n) noexcept { notifier_ = n; }
+
+  /// Returns the notifier attached with set_notifier(), or nullptr.
+  Notifier* notifier() const noexcept { return notifier_; }
+
+  /// Takes the tickets of push() and pop() through a, nullptr goes back to
+  /// a fetch_add per operation. An aggregator serves one queue only, as
+  /// its funnels hand out tickets of this queue's counters: throws
+  /// std::invalid_argument if a is attached to another queue. The queue
+  /// detaches it when it is replaced or the queue is destroyed. Not thread
+  /// safe, set it before the queue is shared.
+  void set_aggregator(TicketAggregator* a) {
+    if (a != nullptr && !a->Attach(this)) {
+      throw std::invalid_argument("aggregator is attached to another queue");
+    }
+    if (aggregator_ != nullptr && aggregator_ != a)
+      aggregator_->Detach(this);
+    aggregator_ = a;
+  }
+
+  /// Lets push() and pop() of the volatile queue pair up through e while
+  /// the queue is empty, nullptr turns it off. An array serves one queue
+  /// only, as a pair it forms must be ordered against this queue's ring:
+  /// throws std::invalid_argument if e is attached to another queue. The
+  /// queue detaches it when it is replaced or the queue is destroyed. Not
+  /// thread safe, set it before the queue is shared.
+  void set_elimination(EliminationArray<T>* e) {
+    if (e != nullptr && !e->Attach(this)) {
+      throw std::invalid_argument("elimination array is attached to another "
+                                  "queue");
+    }
+    if (elimination_ != nullptr && elimination_ != e)
+      elimination_->Detach(this);
+    elimination_ = e;
+  }
+
+  /// push_batch() and pop_batch() prefetch for writing the slots of their
+  /// batch up to distance ahead of the one they fill. After taking a ticket
+  /// push() and pop() prefetch the slot of the ticket distance ahead for
+  /// reading only, as its holder may be spinning on it. Off (0) by default:
+  /// turn it on where a sweep with a ring larger than the caches shows a
+  /// gain.
+  void set_prefetch_distance(size_t distance) noexcept {
+    prefetchDistance_ = distance;
+  }
+
+  size_t prefetch_distance() const noexcept { return prefetchDistance_; }
+
+  /// Selects how the persistent push and pop write back their slot. Auto,
+  /// the default, uses the best flush instruction of the cpu and writes
+  /// payloads of nonTemporalThreshold bytes or more with non-temporal stores.
+  /// When the slots are not on persistent memory (is_pmem() is false) only
+  /// msync makes them durable, so Auto means Pool there.
+  /// Throws std::invalid_argument if the cpu lacks the instruction or if the
+  /// slots are not on persistent memory and s is neither Auto nor Pool. Not
+  /// thread safe.
+  void set_flush_strategy(FlushStrategy s) {
+    if (!flushStrategySupported(s)) {
+      throw std::invalid_argument(std::string("flush strategy not supported: ") +
+                                  flushStrategyName(s));
+    }
+    if (s == FlushStrategy::NonTemporal && !std::is_trivially_copyable<T>::value) {
+      throw std::invalid_argument("non-temporal stores need a trivially copyable T");
+    }
+    if (!isPmem_ && s != FlushStrategy::Auto && s != FlushStrategy::Pool) {
+      throw std::invalid_argument(std::string("flush strategy needs persistent memory: ") +
+                                  flushStrategyName(s));
+    }
+    flushStrategy_ = s;
+    if (!isPmem_) {
+      ntPayload_ = false;
+      flushInsn_ = FlushStrategy::Pool;
+      return;
+    }
+    ntPayload_ = std::is_trivially_copyable<T>::value &&
+                 (s == FlushStrategy::NonTemporal ||
+                  (s == FlushStrategy::Auto && sizeof(T) >= nonTemporalThreshold));
+    flushInsn_ = s == FlushStrategy::Auto || s == FlushStrategy::NonTemporal
+                     ? detectFlushStrategy()
+                     : s;
+  }
+
+  FlushStrategy flush_strategy() const noexcept { return flushStrategy_; }
+
 private:
   constexpr size_t idx(size_t i) const noexcept { return i % capacity_; }
   constexpr size_t turn(size_t i) const noexcept { return i / capacity_; }
+  // Number of tickets before ticket that map to slot i
+  constexpr size_t ticketsBefore(size_t ticket, size_t i) const noexcept {
+    return turn(ticket) + (i < idx(ticket));
+  }
+
+  void FlushLines(const void* addr, size_t len) noexcept {
+    switch (flushInsn_) {
+#if defined(__x86_64__) || defined(__i386__)
+    case FlushStrategy::Clwb:
+      clwbLines(addr, len);
+      return;
+    case FlushStrategy::ClflushOpt:
+      clflushoptLines(addr, len);
+      return;
+    case FlushStrategy::Clflush:
+      clflushLines(addr, len);
+      return;
+#endif
+    default:
+      PersistFlush(addr, len);
+    }
+  }
+
+  void Drain() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    if (flushInsn_ != FlushStrategy::Pool) {
+      // clflush is ordered with the stores, only non-temporal stores and the
+      // weakly ordered flushes need the fence
+      if (flushInsn_ != FlushStrategy::Clflush || ntPayload_)
+        _mm_sfence();
+      return;
+    }
+#endif
+    PersistDrain();
+  }
+
+  // Write back through the backend: pool::flush() of libpmemobj, or libpmem
+  // directly for a file, with msync if it is not on persistent memory
+  void PersistFlush(const void* addr, size_t len) noexcept {
+    if (backend_ == Backend::PmemObj)
+      pop_.flush(addr, len);
+    else if (isPmem_)
+      pmem_flush(addr, len);
+    else
+      pmem_msync(addr, len);
+  }
+
+  void PersistDrain() noexcept {
+    if (backend_ == Backend::PmemObj)
+      pop_.drain();
+    else if (isPmem_)
+      pmem_drain();
+  }
+
+  void Persist(const void* addr, size_t len) noexcept {
+    PersistFlush(addr, len);
+    PersistDrain();
+  }
+
+  // The slot of another thread's ticket, shared so that a holder spinning
+  // on its turn keeps the line
+  template <typename S>
+  void PrefetchAhead(S* slots, size_t ticket) const noexcept {
+    if (prefetchDistance_ != 0)
+      __builtin_prefetch(&slots[idx(ticket)], 0);
+  }
+
+  // n slots of tickets the caller holds, for writing
+  void PrefetchOwn(size_t first, size_t n) const noexcept {
+    for (size_t k = 0; k < n; ++k)
+      __builtin_prefetch(&slots_[idx(first + k)], 1);
+  }
+
+  size_t TakeTicket(std::atomic<size_t>& counter, unsigned side) noexcept {
+    if (aggregator_ != nullptr)
+      return aggregator_->take(counter, side, Ordering::ticket);
+    return counter.fetch_add(1, Ordering::ticket);
+  }
+
+  void Notify() noexcept {
+    if (notifier_ != nullptr)
+      notifier_->notify();
+  }
+
+  // Resolves the tickets of slot i that no operation holds after
+  // RecoverLazy(): everything before lazyTail_ counts as dequeued and an
+  // enqueue before lazyHead_ that never completed leaves a hole, which is
+  // marked as enqueued and dequeued.
+  void LazyResolve(size_t i) noexcept {
+    auto& turnRef = pSlots_[i].get_rw().turn;
+    auto const dequeued = 2 * ticketsBefore(lazyTail_, i);
+    auto const enqueued = ticketsBefore(lazyHead_, i);
+    for (;;) {
+      auto t = turnRef.load(Ordering::turnLoad);
+      size_t resolved;
+      if (t < dequeued)
+        resolved = dequeued;
+      else if (t % 2 == 0 && t / 2 < enqueued)
+        resolved = t + 2;
+      else
+        return;
+      if (turnRef.compare_exchange_strong(t, resolved))
+        Persist(&turnRef, sizeof(turnRef));
+    }
+  }
+
+  // Waits for the turn of ticket to enqueue (parity 0) or dequeue (parity 1)
+  // after RecoverLazy(). Returns false if the ticket was already used before
+  // the crash and must be skipped.
+  bool LazyWait(size_t ticket, size_t parity) noexcept {
+    auto const i = idx(ticket);
+    auto const& turnRef = pSlots_[i].get_ro().turn;
+    for (;;) {
+      auto const t = turnRef.load(Ordering::turnLoad);
+      if (t == turn(ticket) * 2 + parity)
+        return true;
+      if (t > turn(ticket) * 2 + parity)
+        return false;
+      LazyResolve(i);
+    }
+  }
 
   const size_t capacity_;
   bool isPersistent_;
+  Backend backend_;
   std::string poolPath_;
+  size_t arenaBytes_;
 #if defined(__has_cpp_attribute) && __has_cpp_attribute(no_unique_address)
-  Allocator allocator_ [[no_unique_address]];
+  SlotAllocator allocator_ [[no_unique_address]];
 #else
-  Allocator allocator_;
+  SlotAllocator allocator_;
 #endif
   // Align to avoid false sharing between head_ and tail_
-  alignas(hardwareInterferenceSize) std::atomic<size_t> head_;
-  alignas(hardwareInterferenceSize) std::atomic<size_t> tail_;
-  Slot<T>* slots_;
+  alignas(Padding) std::atomic<size_t> head_;
+  alignas(Padding) std::atomic<size_t> tail_;
+  VolatileSlot* slots_;
 
-  RootPool pop_;
+  pmem::obj::pool_base pop_;
+  // The pool root, or the directory entry of a QueuePool
+  pmem::obj::persistent_ptr<Root> root_;
+  bool ownsPool_ = true;
   PSlot* pSlots_;
 
+  // Backend::PmemFile: a header, then two arrays of capacity_ + 1 slots
+  struct FileHeader {
+    static constexpr uint64_t Magic = 0x4d504d4346494c45; // "MPMCFILE"
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t slotSize;
+    uint64_t active; // slot array in use
+    // Pushes below this ticket are in the file when it is the mirror of a
+    // Replicator
+    uint64_t replicated;
+  };
+  static_assert(sizeof(FileHeader) <= hardwareInterferenceSize,
+                "file header must fit in a cache line");
+  // The slots follow the header at a multiple of the padding
+  static constexpr size_t fileHeaderSize =
+      Padding > hardwareInterferenceSize ? Padding : hardwareInterferenceSize;
+  FileHeader* file_ = nullptr;
+  size_t fileLen_ = 0;
+  bool isPmem_ = false;
+  bool keepPool_ = false;
+
+  // Bounds found by RecoverLazy(), tickets from lazyLimit_ on are not affected
+  size_t lazyTail_ = 0;
+  size_t lazyHead_ = 0;
+  size_t lazyLimit_ = 0;
+  std::thread sweeper_;
+
+  Notifier* notifier_ = nullptr;
+  TicketAggregator* aggregator_ = nullptr;
+  EliminationArray<T>* elimination_ = nullptr;
+  size_t prefetchDistance_ = 0;
+
+  // See set_flush_strategy(), flushInsn_ is never Auto or NonTemporal
+  FlushStrategy flushStrategy_ = FlushStrategy::Pool;
+  FlushStrategy flushInsn_ = FlushStrategy::Pool;
+  bool ntPayload_ = false;
+
+  template <typename, typename>
+  friend class ArenaQueue;
+  friend class QueuePool;
+  template <typename>
+  friend class Replicator;
+  template <typename, typename>
+  friend class RelaxedQueue;
+
+  // A queue of a QueuePool, see QueuePool::open()
+  Queue(pmem::obj::pool_base pool, pmem::obj::persistent_ptr<Root> root, size_t capacity)
+      : capacity_(capacity), isPersistent_(true), backend_(Backend::PmemObj), arenaBytes_(0),
+        allocator_(), head_(0), tail_(0), pop_(pool), root_(root), ownsPool_(false) {
+    QueueAttachRoot();
+  }
+
 public:
   auto RecoverTest(pmem::obj::pool_base pool, PSlot* input, std::size_t cap) {
     return RecoverImpl(pool, std::span<PSlot>{input, cap});
@@ -586,7 +1687,9 @@ public:
 } // namespace mpmc
 
 template <typename T,
-          typename Allocator = mpmc::AlignedAllocator<mpmc::Slot<T>>>
-using MPMCQueue = mpmc::Queue<T, Allocator>;
+          typename Allocator = mpmc::AlignedAllocator<mpmc::Slot<T>>,
+          typename Ordering = mpmc::DefaultOrdering,
+          size_t Padding = mpmc::hardwareInterferenceSize>
+using MPMCQueue = mpmc::Queue<T, Allocator, Ordering, Padding>;
 
 } // namespace rigtorp
@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace rigtorp {
+namespace mpmc {
+
+/// Readiness notification for consumers that sleep in an event loop. fd() is
+/// an eventfd that becomes readable when an item is pushed to a queue the
+/// notifier is attached to (see Queue::set_notifier()) while a consumer
+/// sleeps. Several queues can share a notifier.
+///
+/// Producers only write to the eventfd when a consumer has announced with
+/// arm() that it is about to sleep, so under load a push costs a fence and a
+/// load and no syscall. A consumer drains its queues with try_pop(), calls
+/// arm(), checks the queues once more and only then waits for fd(); when fd()
+/// is readable it calls clear() and starts over. Every sleeping consumer is
+/// woken by one token, and a token left over from a consumer that found work
+/// after arm() causes a spurious wakeup at most.
+class Notifier {
+public:
+  Notifier() : fd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE)) {
+    if (fd_ < 0)
+      throw std::system_error(errno, std::generic_category(), "eventfd");
+  }
+  ~Notifier() noexcept { ::close(fd_); }
+
+  // non-copyable and non-movable
+  Notifier(const Notifier&) = delete;
+  Notifier& operator=(const Notifier&) = delete;
+
+  /// The eventfd to wait for, readable while a wakeup is pending.
+  int fd() const noexcept { return fd_; }
+
+  /// Called after an item was pushed. Wakes the consumers that armed.
+  void notify() noexcept {
+    // Orders the push before the load of sleepers_, pairs with the fence in
+    // arm()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) == 0)
+      return;
+    auto const n = sleepers_.exchange(0, std::memory_order_relaxed);
+    if (n != 0)
+      Write(n);
+  }
+
+  /// Announces that the calling consumer is about to wait for fd(). It must
+  /// check its queues again afterwards, an item pushed before arm() does not
+  /// wake it.
+  void arm() noexcept {
+    sleepers_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  /// Withdraws arm() when the consumer found an item and does not wait.
+  void disarm() noexcept {
+    auto n = sleepers_.load(std::memory_order_relaxed);
+    while (n != 0 &&
+           !sleepers_.compare_exchange_weak(n, n - 1, std::memory_order_relaxed))
+      ;
+  }
+
+  /// Consumes one wakeup. Returns false if none was pending.
+  bool clear() noexcept {
+    uint64_t v;
+    return ::read(fd_, &v, sizeof(v)) == sizeof(v);
+  }
+
+  /// Waits for fd() without an event loop, at most timeoutMs milliseconds or
+  /// indefinitely if it is negative, and consumes the wakeup. Returns false
+  /// on timeout.
+  bool wait(int timeoutMs = -1) noexcept {
+    pollfd p{fd_, POLLIN, 0};
+    while (::poll(&p, 1, timeoutMs) < 0 && errno == EINTR)
+      ;
+    return (p.revents & POLLIN) != 0 && clear();
+  }
+
+private:
+  void Write(uint64_t n) noexcept {
+    while (::write(fd_, &n, sizeof(n)) < 0 && errno == EINTR)
+      ;
+  }
+
+  int fd_;
+  std::atomic<uint64_t> sleepers_{0};
+};
+} // namespace mpmc
+} // namespace rigtorp
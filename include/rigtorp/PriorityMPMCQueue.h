@@ -0,0 +1,223 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "MPMCQueue.h"
+#include "QueueSet.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// Volatile MPMC queue with K priority lanes, lane 0 being the most urgent.
+/// Every lane is a ring of its own, so bulk items filling one lane never
+/// delay a push to another. A bitmap with a bit per lane that may have
+/// items lets a consumer find the most urgent non-empty lane with one load
+/// and a count of trailing zeros.
+///
+/// Pick::Priority always pops from the most urgent non-empty lane.
+/// Pick::Weighted pops the lanes in proportion to their weights, following a
+/// smooth weighted round robin schedule shared by all consumers, and
+/// Pick::RoundRobin is Weighted with equal weights. Both fall back to the
+/// most urgent non-empty lane when the scheduled one is empty, so no pop
+/// fails while some lane has items.
+///
+/// A bit is set by the push that may have made its lane non-empty and
+/// cleared by a pop that found the lane empty, which then looks at the lane
+/// again: a fence on both sides ensures one of them sees the other, so a
+/// bit is never left clear while its lane has items.
+template <typename T, size_t K, typename Q = Queue<T>>
+class PriorityMPMCQueue {
+  static_assert(K >= 1 && K <= 64, "the lane bitmap has 64 bits");
+
+public:
+  /// Every lane holds capacity items. weights are only used by
+  /// Pick::Weighted and must be positive there.
+  explicit PriorityMPMCQueue(size_t capacity, Pick pick = Pick::Priority,
+                             std::array<unsigned, K> weights = {}) {
+    for (auto& lane : lanes_)
+      lane = std::make_unique<Q>(capacity, Backend::Volatile);
+    if (pick == Pick::RoundRobin)
+      weights.fill(1);
+    if (pick != Pick::Priority)
+      Schedule(weights);
+  }
+
+  // non-copyable and non-movable
+  PriorityMPMCQueue(const PriorityMPMCQueue&) = delete;
+  PriorityMPMCQueue& operator=(const PriorityMPMCQueue&) = delete;
+
+  template <typename... Args>
+  void emplace(size_t lane, Args&&... args) noexcept {
+    assert(lane < K);
+    lanes_[lane]->emplace_v(std::forward<Args>(args)...);
+    Mark(lane);
+  }
+
+  template <typename... Args>
+  bool try_emplace(size_t lane, Args&&... args) noexcept {
+    assert(lane < K);
+    if (!lanes_[lane]->try_emplace(std::forward<Args>(args)...))
+      return false;
+    Mark(lane);
+    return true;
+  }
+
+  void push(size_t lane, const T& v) noexcept { emplace(lane, v); }
+  template <typename P,
+            typename = typename std::enable_if<
+                std::is_nothrow_constructible<T, P&&>::value>::type>
+  void push(size_t lane, P&& v) noexcept {
+    emplace(lane, std::forward<P>(v));
+  }
+
+  bool try_push(size_t lane, const T& v) noexcept {
+    return try_emplace(lane, v);
+  }
+  template <typename P,
+            typename = typename std::enable_if<
+                std::is_nothrow_constructible<T, P&&>::value>::type>
+  bool try_push(size_t lane, P&& v) noexcept {
+    return try_emplace(lane, std::forward<P>(v));
+  }
+
+  /// Pops from the lane picked by the policy. Returns false if all lanes
+  /// are empty. If from is not null it is set to the lane.
+  bool try_pop(T& v, size_t* from = nullptr) noexcept {
+    // Lanes found empty by this call
+    uint64_t tried = 0;
+    if (!schedule_.empty()) {
+      auto const lane =
+          schedule_[round_.fetch_add(1, std::memory_order_relaxed) %
+                    schedule_.size()];
+      if (nonEmpty_.load(std::memory_order_acquire) & Bit(lane)) {
+        if (TryLane(lane, v, from))
+          return true;
+        tried |= Bit(lane);
+      }
+    }
+    for (;;) {
+      auto const ready = nonEmpty_.load(std::memory_order_acquire) & ~tried;
+      if (ready == 0)
+        return false;
+      auto const lane = static_cast<size_t>(std::countr_zero(ready));
+      if (TryLane(lane, v, from))
+        return true;
+      tried |= Bit(lane);
+    }
+  }
+
+  /// Pops from the lane picked by the policy, waiting while all are empty.
+  void pop(T& v, size_t* from = nullptr) noexcept {
+    while (!try_pop(v, from))
+      std::this_thread::yield();
+  }
+
+  /// Returns the number of items in all lanes, a best effort guess like
+  /// Queue::size().
+  ptrdiff_t size() const noexcept {
+    ptrdiff_t n = 0;
+    for (auto& lane : lanes_)
+      n += lane->size();
+    return n;
+  }
+
+  ptrdiff_t size(size_t lane) const noexcept { return lanes_[lane]->size(); }
+
+  bool empty() const noexcept { return size() <= 0; }
+
+  static constexpr size_t lanes() noexcept { return K; }
+
+private:
+  static constexpr uint64_t Bit(size_t lane) noexcept {
+    return uint64_t(1) << lane;
+  }
+
+  // Called after a push to lane. The fence orders the push before the load
+  // of the bitmap, pairs with the fence in TryLane()
+  void Mark(size_t lane) noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!(nonEmpty_.load(std::memory_order_relaxed) & Bit(lane)))
+      nonEmpty_.fetch_or(Bit(lane), std::memory_order_release);
+  }
+
+  bool TryLane(size_t lane, T& v, size_t* from) noexcept {
+    if (lanes_[lane]->try_pop(v)) {
+      if (from != nullptr)
+        *from = lane;
+      return true;
+    }
+    // The lane looks empty. Clear its bit and look again, a push that saw
+    // the bit still set before it was cleared did not set it again
+    nonEmpty_.fetch_and(~Bit(lane), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!lanes_[lane]->empty())
+      nonEmpty_.fetch_or(Bit(lane), std::memory_order_release);
+    return false;
+  }
+
+  // Lays out one round of the smooth weighted round robin: every lane
+  // earns its weight per step and the richest one is charged the total
+  void Schedule(const std::array<unsigned, K>& weights) {
+    int64_t total = 0;
+    for (auto const w : weights) {
+      if (w == 0)
+        throw std::invalid_argument("weight must be positive");
+      total += w;
+    }
+    if (total > 65536)
+      throw std::invalid_argument("weights must sum to at most 65536");
+    std::array<int64_t, K> current{};
+    schedule_.reserve(static_cast<size_t>(total));
+    for (int64_t step = 0; step < total; ++step) {
+      size_t best = 0;
+      for (size_t i = 0; i < K; ++i) {
+        current[i] += weights[i];
+        if (current[i] > current[best])
+          best = i;
+      }
+      current[best] -= total;
+      schedule_.push_back(static_cast<uint8_t>(best));
+    }
+  }
+
+  std::array<std::unique_ptr<Q>, K> lanes_;
+  std::vector<uint8_t> schedule_; // lanes in weighted order, empty for Priority
+
+  // Align to avoid false sharing between the bitmap and the round counter
+  alignas(hardwareInterferenceSize) std::atomic<uint64_t> nonEmpty_{0};
+  alignas(hardwareInterferenceSize) std::atomic<size_t> round_{0};
+};
+} // namespace mpmc
+} // namespace rigtorp
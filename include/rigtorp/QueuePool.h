@@ -0,0 +1,258 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+#include <libpmemobj.h>
+#include <libpmemobj++/make_persistent_array_atomic.hpp>
+#include <libpmemobj++/p.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+
+#include "MPMCQueue.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// A single pmemobj pool holding any number of named persistent queues, so
+/// that a service with many queues maps, checks and recovers one pool instead
+/// of one per queue. The pool root is a fixed size directory of entries, each
+/// naming the root of one queue.
+///
+/// A queue is opened at most once at a time and every queue must be destroyed
+/// before its QueuePool. Opening and removing queues is thread safe, the
+/// queues themselves are used like any other Queue and, like one, need
+/// Recover() after the pool is reopened, see RecoverAll().
+///
+/// Each entry records the type of its items as a hash of the mangled name
+/// from typeid(T) and of alignof(T), a queue is opened and removed with the
+/// type it was created with only. The mangled name is that of the C++ ABI,
+/// a pool moves between builds of the same ABI only.
+class QueuePool {
+public:
+  static constexpr size_t NameSize = 56;
+
+  QueuePool(std::string poolPath, size_t poolBytes, size_t maxQueues = 64)
+      : poolPath_(std::move(poolPath)) {
+    if (poolPath_.empty())
+      throw std::invalid_argument("invalid pool path");
+    if (maxQueues < 1)
+      throw std::invalid_argument("maxQueues < 1");
+    const auto layout = std::filesystem::path{poolPath_}.filename().string();
+    if (std::filesystem::exists(poolPath_) == false) {
+      pop_ = DirectoryPool::create(poolPath_, layout, std::max<size_t>(poolBytes, PMEMOBJ_MIN_POOL));
+    } else {
+      pop_ = DirectoryPool::open(poolPath_, layout);
+      if (!pop_.root()->cleanShutdown_) {
+        // Same as Queue, only a crashed pool needs the full check
+        pop_.close();
+        if (DirectoryPool::check(poolPath_, layout) == 0)
+          throw std::runtime_error("poolfile is in inconsistent state");
+        pop_ = DirectoryPool::open(poolPath_, layout);
+      }
+    }
+    auto root = pop_.root();
+    if (root->entries_ == nullptr) {
+      pmem::obj::make_persistent_atomic<Entry[]>(pop_, root->entries_, maxQueues);
+      root->maxQueues_ = maxQueues;
+      root.persist();
+    }
+    entries_ = root->entries_.get();
+    maxQueues_ = root->maxQueues_;
+    SetCleanShutdown(false);
+  }
+
+  // non-copyable and non-movable
+  QueuePool(const QueuePool&) = delete;
+  QueuePool& operator=(const QueuePool&) = delete;
+
+  ~QueuePool() noexcept {
+    SetCleanShutdown(true);
+    pop_.close();
+  }
+
+  /// Opens the queue called name, creating it if it does not exist. Throws
+  /// std::invalid_argument if it exists with another capacity or type and
+  /// std::length_error if the directory is full.
+  template <typename T>
+  std::unique_ptr<Queue<T>> open(std::string_view name, size_t capacity) {
+    using Q = Queue<T>;
+    CheckName(name);
+    if (capacity < 1)
+      throw std::invalid_argument("capacity < 1");
+    std::lock_guard lock(mutex_);
+    auto* entry = Find(name);
+    if (entry != nullptr) {
+      if (entry->capacity_ != capacity || !IsType<T>(*entry))
+        throw std::invalid_argument("queue exists with another capacity or type");
+    } else {
+      entry = Find({});
+      if (entry == nullptr)
+        throw std::length_error("queue directory is full");
+      // A crash while creating or removing a queue can leave an unnamed root
+      // behind, its slots are never allocated before the name is written
+      if (OID_IS_NULL(entry->root_) &&
+          pmemobj_zalloc(pop_.handle(), &entry->root_, sizeof(typename Q::Root), 0) != 0) {
+        throw std::bad_alloc();
+      }
+      entry->capacity_ = capacity;
+      entry->slotSize_ = sizeof(typename Q::PSlot);
+      entry->typeSize_ = sizeof(T);
+      entry->typeId_ = TypeId<T>();
+      pop_.persist(entry, sizeof(Entry));
+      // The name is written last, it makes the entry valid
+      std::memcpy(entry->name_, name.data(), name.size());
+      pop_.persist(entry->name_, name.size());
+    }
+    return std::unique_ptr<Q>(
+        new Q(pop_, pmem::obj::persistent_ptr<typename Q::Root>(entry->root_), capacity));
+  }
+
+  /// Removes the queue called name and frees its slots. The queue must not be
+  /// open. Returns false if there is no such queue.
+  template <typename T>
+  bool remove(std::string_view name) {
+    using Q = Queue<T>;
+    CheckName(name);
+    std::lock_guard lock(mutex_);
+    auto* entry = Find(name);
+    if (entry == nullptr)
+      return false;
+    if (!IsType<T>(*entry))
+      throw std::invalid_argument("queue exists with another type");
+    pmem::obj::persistent_ptr<typename Q::Root> root(entry->root_);
+    if (root->pSlots_ != nullptr) {
+      pmem::obj::delete_persistent_atomic<typename Q::PSlotArray>(root->pSlots_,
+                                                                  entry->capacity_ + 1);
+      root->pSlots_ = nullptr;
+      root.persist();
+    }
+    std::memset(entry->name_, 0, NameSize);
+    pop_.persist(entry->name_, NameSize);
+    pmemobj_free(&entry->root_);
+    pop_.persist(&entry->root_, sizeof(entry->root_));
+    return true;
+  }
+
+  /// Returns the names of the queues in the pool
+  std::vector<std::string> names() const {
+    std::lock_guard lock(mutex_);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < maxQueues_; ++i) {
+      if (entries_[i].name_[0] != '\0')
+        names.emplace_back(Name(entries_[i]));
+    }
+    return names;
+  }
+
+  size_t max_queues() const noexcept { return maxQueues_; }
+
+  /// Recovers the given queues in parallel, one thread per queue. Like
+  /// Queue::Recover(), nothing else may use them meanwhile.
+  template <typename... Qs>
+  static void RecoverAll(Qs&... queues) {
+    std::vector<std::thread> threads;
+    threads.reserve(sizeof...(queues));
+    (threads.emplace_back([&queues] { queues.Recover(); }), ...);
+    for (auto& t : threads)
+      t.join();
+  }
+
+private:
+  struct Entry {
+    char name_[NameSize]; // empty if the entry is free
+    pmem::obj::p<uint64_t> capacity_;
+    pmem::obj::p<uint64_t> slotSize_;
+    pmem::obj::p<uint64_t> typeSize_;
+    pmem::obj::p<uint64_t> typeId_; // see TypeId()
+    PMEMoid root_; // Queue<T>::Root
+  };
+  struct Directory {
+    pmem::obj::persistent_ptr<Entry[]> entries_;
+    pmem::obj::p<uint64_t> maxQueues_;
+    pmem::obj::p<bool> cleanShutdown_;
+  };
+  using DirectoryPool = pmem::obj::pool<Directory>;
+
+  static void CheckName(std::string_view name) {
+    if (name.empty() || name.size() >= NameSize || name.find('\0') != name.npos)
+      throw std::invalid_argument("invalid queue name");
+  }
+
+  static std::string_view Name(const Entry& entry) noexcept {
+    return {entry.name_, strnlen(entry.name_, NameSize)};
+  }
+
+  // FNV-1a of the mangled name of T followed by alignof(T)
+  template <typename T>
+  static uint64_t TypeId() noexcept {
+    uint64_t h = 14695981039346656037ull;
+    auto const mix = [&h](unsigned char c) { h = (h ^ c) * 1099511628211ull; };
+    for (const char* c = typeid(T).name(); *c != '\0'; ++c)
+      mix(static_cast<unsigned char>(*c));
+    mix(static_cast<unsigned char>(alignof(T)));
+    return h;
+  }
+
+  template <typename T>
+  static bool IsType(const Entry& entry) noexcept {
+    return entry.slotSize_ == sizeof(typename Queue<T>::PSlot) &&
+           entry.typeSize_ == sizeof(T) && entry.typeId_ == TypeId<T>();
+  }
+
+  // Returns the entry called name, an empty name finds a free entry
+  Entry* Find(std::string_view name) const noexcept {
+    for (size_t i = 0; i < maxQueues_; ++i) {
+      if (Name(entries_[i]) == name)
+        return &entries_[i];
+    }
+    return nullptr;
+  }
+
+  void SetCleanShutdown(bool clean) {
+    auto& flag = pop_.root()->cleanShutdown_;
+    flag = clean;
+    pop_.persist(flag);
+  }
+
+  std::string poolPath_;
+  DirectoryPool pop_;
+  Entry* entries_ = nullptr;
+  size_t maxQueues_ = 0;
+  mutable std::mutex mutex_;
+};
+} // namespace mpmc
+} // namespace rigtorp
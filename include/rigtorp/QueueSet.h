@@ -0,0 +1,187 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "MPMCQueue.h"
+#include "Notifier.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// How QueueSet picks among the queues that have items.
+enum class Pick {
+  RoundRobin, // the next queue after the last one popped from
+  Weighted,   // smooth weighted round robin, in proportion to the weights
+  Priority,   // the first queue added wins
+};
+
+/// Lets one consumer pop from whichever of several volatile queues has items.
+/// A pop looks at the sizes of all queues once, takes the pick of those with
+/// items, and only tries another one if a competing consumer emptied it
+/// first. A blocking pop parks on one Notifier attached to all queues and is
+/// woken by the first push to any of them.
+///
+/// A QueueSet is used by a single consumer thread. A queue can be in one set
+/// only, as it has one notifier, but other threads may pop from it directly.
+/// The set leaves alone a notifier attached to a queue after it was added.
+template <typename T, typename Q = Queue<T>>
+class QueueSet {
+  struct Member {
+    Q* q;
+    int64_t weight;
+    int64_t current; // credit of the weighted pick
+  };
+
+public:
+  explicit QueueSet(Pick pick = Pick::RoundRobin) : pick_(pick) {}
+
+  ~QueueSet() noexcept {
+    for (auto& m : members_) {
+      if (m.q->notifier() == &notifier_)
+        m.q->set_notifier(nullptr);
+    }
+  }
+
+  // non-copyable and non-movable
+  QueueSet(const QueueSet&) = delete;
+  QueueSet& operator=(const QueueSet&) = delete;
+
+  /// Adds q with the given weight for Pick::Weighted and returns its index.
+  /// Throws std::invalid_argument if q already has a notifier, such as that
+  /// of another set. Not thread safe with respect to pushes to q, add it
+  /// before it is shared.
+  size_t add(Q& q, unsigned weight = 1) {
+    if (weight == 0)
+      throw std::invalid_argument("weight must be positive");
+    if (q.notifier() != nullptr)
+      throw std::invalid_argument("queue already has a notifier");
+    q.set_notifier(&notifier_);
+    members_.push_back(Member{&q, static_cast<int64_t>(weight), 0});
+    ready_.reserve(members_.size());
+    return members_.size() - 1;
+  }
+
+  /// Pops from the pick of the queues that have items. Returns false if all
+  /// are empty. If from is not null it is set to the index of the queue.
+  bool try_pop(T& v, size_t* from = nullptr) noexcept {
+    auto const n = members_.size();
+    ready_.assign(n, false);
+    size_t candidates = 0;
+    for (size_t i = 0; i < n; ++i) {
+      ready_[i] = !members_[i].q->empty();
+      candidates += ready_[i];
+    }
+    while (candidates > 0) {
+      auto const i = Choose();
+      if (members_[i].q->try_pop(v)) {
+        Popped(i);
+        if (from != nullptr)
+          *from = i;
+        return true;
+      }
+      // Another consumer was faster
+      ready_[i] = false;
+      --candidates;
+    }
+    return false;
+  }
+
+  /// Pops from the pick of the queues, waiting for a push if all are empty.
+  void pop(T& v, size_t* from = nullptr) noexcept {
+    for (;;) {
+      if (try_pop(v, from))
+        return;
+      notifier_.arm();
+      if (try_pop(v, from)) {
+        notifier_.disarm();
+        return;
+      }
+      notifier_.wait();
+    }
+  }
+
+  /// Readable when a queue may have become non-empty while the consumer
+  /// slept, for consumers in an event loop: see Notifier.
+  Notifier& notifier() noexcept { return notifier_; }
+
+  size_t size() const noexcept { return members_.size(); }
+
+private:
+  // Returns a ready queue, there is at least one
+  size_t Choose() const noexcept {
+    auto const n = members_.size();
+    switch (pick_) {
+    case Pick::Priority:
+      break;
+    case Pick::Weighted: {
+      // Every ready queue earns its weight and the richest one is picked,
+      // Popped() charges it what all earned
+      size_t best = n;
+      for (size_t i = 0; i < n; ++i) {
+        if (ready_[i] && (best == n || members_[i].current + members_[i].weight >
+                                           members_[best].current + members_[best].weight))
+          best = i;
+      }
+      return best;
+    }
+    case Pick::RoundRobin:
+      for (size_t k = 0; k < n; ++k) {
+        auto const i = (next_ + k) % n;
+        if (ready_[i])
+          return i;
+      }
+      break;
+    }
+    size_t i = 0;
+    while (!ready_[i])
+      ++i;
+    return i;
+  }
+
+  void Popped(size_t i) noexcept {
+    next_ = i + 1;
+    if (pick_ == Pick::Weighted) {
+      int64_t earned = 0;
+      for (size_t k = 0; k < members_.size(); ++k) {
+        if (ready_[k]) {
+          members_[k].current += members_[k].weight;
+          earned += members_[k].weight;
+        }
+      }
+      members_[i].current -= earned;
+    }
+  }
+
+  const Pick pick_;
+  std::vector<Member> members_;
+  std::vector<bool> ready_; // queues with items, in try_pop()
+  size_t next_ = 0;          // where the round robin continues
+  Notifier notifier_;
+};
+} // namespace mpmc
+} // namespace rigtorp
@@ -0,0 +1,312 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "MPMCQueue.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// Relaxed FIFO mode of a volatile queue: every producer and consumer
+/// leases a block of consecutive tickets from head_ or tail_ with one
+/// fetch_add and uses them one by one, so the shared counters are touched
+/// once per block instead of once per operation. Threads use the queue
+/// through a Producer or a Consumer handle each, which holds its lease.
+///
+/// Ordering: the items of one producer take increasing tickets and a
+/// consumer pops its tickets in increasing order, so a consumer sees the
+/// items of a producer in the order they were pushed as long as it keeps
+/// its lease. There is no order between producers, a push may land before
+/// items pushed earlier by another producer whose lease is older, and an
+/// item is only popped once the consumer holding its ticket gets to it.
+///
+/// Tickets left in a lease are not lost. A producer's release() abandons
+/// them and a consumer that reaches an abandoned ticket moves on once the
+/// slot is free for it. A consumer's release() hands them back, and a
+/// consumer waiting on a newer ticket takes the oldest handed back range
+/// first, so no slot is left unserved while consumers are running; items
+/// of such a range are popped out of order with the ones it had. Neither
+/// release() waits. At most maxReleased ranges of each kind can be pending,
+/// a release() beyond that yields until consumers have worked some off.
+///
+/// Abandoned tickets are only understood by Consumer: a queue with
+/// Producers must not be popped through Queue::pop() or try_pop(), while
+/// pushes through Queue are fine. size() counts leased tickets, so it is
+/// an even rougher guess than usual.
+template <typename T, typename Q = Queue<T>>
+class RelaxedQueue {
+  // Tickets [first, end) of a released lease, remaining of them unserved
+  struct Range {
+    size_t first;
+    size_t end;
+    size_t remaining;
+  };
+
+public:
+  /// Leases block tickets at a time from q, which must be volatile.
+  explicit RelaxedQueue(Q& q, size_t block = 64, size_t maxReleased = 1024)
+      : q_(q), block_(block), maxReleased_(maxReleased) {
+    if (q.is_persistent())
+      throw std::invalid_argument("relaxed mode needs a volatile queue");
+    if (block == 0)
+      throw std::invalid_argument("block must be positive");
+    if (maxReleased == 0)
+      throw std::invalid_argument("maxReleased must be positive");
+    // release() never allocates
+    returned_.reserve(maxReleased);
+    abandoned_.reserve(maxReleased);
+  }
+
+  // non-copyable and non-movable
+  RelaxedQueue(const RelaxedQueue&) = delete;
+  RelaxedQueue& operator=(const RelaxedQueue&) = delete;
+
+  /// Pushes of one thread.
+  class Producer {
+  public:
+    explicit Producer(RelaxedQueue& r) noexcept : r_(r) {}
+    ~Producer() noexcept { release(); }
+
+    // non-copyable and non-movable
+    Producer(const Producer&) = delete;
+    Producer& operator=(const Producer&) = delete;
+
+    template <typename... Args>
+    void emplace(Args&&... args) noexcept {
+      if (next_ == end_) {
+        next_ = r_.q_.head_.fetch_add(r_.block_, std::memory_order_relaxed);
+        end_ = next_ + r_.block_;
+      }
+      r_.Fill(next_++, std::forward<Args>(args)...);
+    }
+
+    void push(const T& v) noexcept { emplace(v); }
+    template <typename P,
+              typename = typename std::enable_if<
+                  std::is_nothrow_constructible<T, P&&>::value>::type>
+    void push(P&& v) noexcept {
+      emplace(std::forward<P>(v));
+    }
+
+    /// Abandons the tickets left in the lease, their consumers skip them.
+    void release() noexcept {
+      if (next_ != end_)
+        r_.Abandon(next_, end_);
+      next_ = end_ = 0;
+    }
+
+    /// Tickets left in the lease.
+    size_t leased() const noexcept { return end_ - next_; }
+
+  private:
+    RelaxedQueue& r_;
+    size_t next_ = 0;
+    size_t end_ = 0;
+  };
+
+  /// Pops of one thread.
+  class Consumer {
+  public:
+    explicit Consumer(RelaxedQueue& r) noexcept : r_(r) {}
+    ~Consumer() noexcept { release(); }
+
+    // non-copyable and non-movable
+    Consumer(const Consumer&) = delete;
+    Consumer& operator=(const Consumer&) = delete;
+
+    /// Pops the item of the next ticket with one, waiting for it.
+    void pop(T& v) noexcept {
+      for (;;) {
+        if (next_ == end_)
+          r_.Lease(next_, end_);
+        switch (r_.TryTake(next_, v)) {
+        case Taken::Item:
+          ++next_;
+          return;
+        case Taken::Abandoned:
+          ++next_;
+          break;
+        case Taken::NotReady:
+          // Older tickets handed back by another consumer may hold up a
+          // producer, serve them first
+          r_.SwapOlder(next_, end_);
+          break;
+        }
+      }
+    }
+
+    /// Hands the tickets left in the lease back to other consumers.
+    void release() noexcept {
+      if (next_ != end_)
+        r_.Return(next_, end_);
+      next_ = end_ = 0;
+    }
+
+    /// Tickets left in the lease.
+    size_t leased() const noexcept { return end_ - next_; }
+
+  private:
+    RelaxedQueue& r_;
+    size_t next_ = 0;
+    size_t end_ = 0;
+  };
+
+  size_t block() const noexcept { return block_; }
+
+private:
+  enum class Taken { Item, Abandoned, NotReady };
+
+  template <typename... Args>
+  void Fill(size_t ticket, Args&&... args) noexcept {
+    auto& slot = q_.slots_[q_.idx(ticket)];
+    auto const turn = q_.turn(ticket) * 2;
+    while (slot.turn.load(std::memory_order_acquire) != turn)
+      ;
+    slot.construct(std::forward<Args>(args)...);
+    slot.turn.store(turn + 1, std::memory_order_release);
+    q_.Notify();
+  }
+
+  Taken TryTake(size_t ticket, T& v) noexcept {
+    auto& slot = q_.slots_[q_.idx(ticket)];
+    auto const turn = q_.turn(ticket) * 2;
+    auto const t = slot.turn.load(std::memory_order_acquire);
+    if (t == turn + 1) {
+      v = slot.move();
+      slot.destroy();
+      slot.turn.store(turn + 2, std::memory_order_release);
+      return Taken::Item;
+    }
+    // The slot waits for the producer of this ticket, which may be gone
+    if (t == turn && abandonedCount_.load(std::memory_order_acquire) != 0 &&
+        Unabandon(ticket)) {
+      slot.turn.store(turn + 2, std::memory_order_release);
+      return Taken::Abandoned;
+    }
+    return Taken::NotReady;
+  }
+
+  // Returns true and counts ticket as served if it was abandoned
+  bool Unabandon(size_t ticket) noexcept {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < abandoned_.size(); ++i) {
+      auto& r = abandoned_[i];
+      if (ticket < r.first || ticket >= r.end)
+        continue;
+      if (--r.remaining == 0) {
+        abandoned_[i] = abandoned_.back();
+        abandoned_.pop_back();
+        abandonedCount_.store(abandoned_.size(), std::memory_order_release);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // The oldest returned range if there is one, else a new block
+  void Lease(size_t& next, size_t& end) noexcept {
+    if (returnedCount_.load(std::memory_order_acquire) != 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!returned_.empty()) {
+        auto const oldest = Oldest();
+        next = returned_[oldest].first;
+        end = returned_[oldest].end;
+        returned_[oldest] = returned_.back();
+        returned_.pop_back();
+        returnedCount_.store(returned_.size(), std::memory_order_release);
+        return;
+      }
+    }
+    next = q_.tail_.fetch_add(block_, std::memory_order_relaxed);
+    end = next + block_;
+  }
+
+  // Trades the lease [next, end) for the oldest returned range if that one
+  // is older
+  void SwapOlder(size_t& next, size_t& end) noexcept {
+    if (returnedCount_.load(std::memory_order_acquire) == 0)
+      return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (returned_.empty())
+      return;
+    auto& r = returned_[Oldest()];
+    if (r.first >= next)
+      return;
+    std::swap(r.first, next);
+    std::swap(r.end, end);
+  }
+
+  size_t Oldest() const noexcept {
+    size_t oldest = 0;
+    for (size_t i = 1; i < returned_.size(); ++i) {
+      if (returned_[i].first < returned_[oldest].first)
+        oldest = i;
+    }
+    return oldest;
+  }
+
+  void Return(size_t next, size_t end) noexcept {
+    Release(returned_, returnedCount_, Range{next, end, end - next});
+  }
+
+  void Abandon(size_t next, size_t end) noexcept {
+    Release(abandoned_, abandonedCount_, Range{next, end, end - next});
+  }
+
+  void Release(std::vector<Range>& ranges, std::atomic<size_t>& count,
+               const Range& r) noexcept {
+    for (;;) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ranges.size() < maxReleased_) {
+          ranges.push_back(r);
+          count.store(ranges.size(), std::memory_order_release);
+          return;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  Q& q_;
+  const size_t block_;
+  const size_t maxReleased_;
+
+  // Released leases, reserved up front so that release() never allocates
+  std::mutex mutex_;
+  std::vector<Range> returned_;  // handed back by consumers
+  std::vector<Range> abandoned_; // left by producers
+  std::atomic<size_t> returnedCount_{0};
+  std::atomic<size_t> abandonedCount_{0};
+};
+} // namespace mpmc
+} // namespace rigtorp
@@ -0,0 +1,207 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "MPMCQueue.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// Mirrors a persistent queue to a second file, e.g. on another device, from
+/// a background thread. The mirror is a queue file of Backend::PmemFile: to
+/// fail over, open it with `Queue<T>(capacity, Backend::PmemFile, path)` and
+/// call Recover().
+///
+/// The thread only reads the slots of the primary queue, so push and pop
+/// run as they would without it. Every pass copies the slots that changed
+/// since the last one and writes them to the mirror in slot order with one
+/// drain per phase; the mirror then persists how far the pushes have been
+/// replicated. A slot is read twice around its payload and copied only when
+/// its turn did not change, and the mirror marks a slot it overwrites as
+/// dequeued first, so a crash of the replicator never leaves a payload under
+/// the turn of another.
+///
+/// Replication is asynchronous: after a failover the operations of the last
+/// interval are missing, items popped then are delivered again and items
+/// pushed then are lost. Start the replicator after Recover() of the primary
+/// and stop it before recovering the primary again.
+template <typename T>
+class Replicator {
+  using Q = Queue<T>;
+  using PSlot = typename Q::PSlot;
+  static_assert(std::is_trivially_copyable<T>::value,
+                "T must be trivially copyable");
+
+public:
+  Replicator(Q& primary, std::string mirrorPath,
+             std::chrono::microseconds interval = std::chrono::microseconds{100})
+      : q_(CheckPrimary(primary)),
+        mirror_(primary.capacity_, Backend::PmemFile, std::move(mirrorPath)),
+        interval_(interval), staged_(q_.capacity_) {
+    mirror_.keep_pool(true);
+    // The first pass copies every slot, the mirror may be stale or new
+    Pass(true);
+    thread_ = std::thread([this] { Run(); });
+  }
+
+  ~Replicator() noexcept { stop(); }
+
+  // non-copyable and non-movable
+  Replicator(const Replicator&) = delete;
+  Replicator& operator=(const Replicator&) = delete;
+
+  /// Replicates what the queue holds now and stops the thread.
+  void stop() noexcept {
+    if (!thread_.joinable())
+      return;
+    stop_.store(true, std::memory_order_relaxed);
+    thread_.join();
+    Pass(false);
+  }
+
+  /// Pushes below this ticket are durable in the mirror.
+  size_t replicated() const noexcept {
+    return replicated_.load(std::memory_order_acquire);
+  }
+
+private:
+  static Q& CheckPrimary(Q& q) {
+    if (!q.isPersistent_)
+      throw std::invalid_argument("the primary queue must be persistent");
+    return q;
+  }
+
+  void Run() noexcept {
+    while (!stop_.load(std::memory_order_relaxed)) {
+      if (!Pass(false))
+        std::this_thread::sleep_for(interval_);
+    }
+  }
+
+  // Copies the slots of the tickets from from_ to the current head, or all
+  // slots. Returns false if nothing changed.
+  bool Pass(bool all) noexcept {
+    auto const cap = q_.capacity_;
+    auto const tail = q_.tail_.load(std::memory_order_acquire);
+    auto const head = q_.head_.load(std::memory_order_acquire);
+    auto const begin = all ? 0 : from_;
+    auto const end = std::max(head, begin);
+    if (end == begin && !all)
+      return false;
+    auto const n = all || end - begin >= cap ? cap : end - begin;
+    auto const first = all || n == cap ? 0 : q_.idx(begin);
+
+    // Take a stable copy of each slot, skipping those the mirror already has
+    auto* mirror = mirror_.pSlots_;
+    size_t changed = 0;
+    for (size_t k = 0; k < n; ++k) {
+      auto const i = (first + k) % cap;
+      auto const& slot = q_.pSlots_[i].get_ro();
+      auto& staged = staged_[i];
+      for (;;) {
+        staged.turn = slot.turn.load(std::memory_order_acquire);
+        std::memcpy(static_cast<void*>(&staged.storage), &slot.storage, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.turn.load(std::memory_order_relaxed) == staged.turn)
+          break;
+      }
+      changed += staged.turn != mirror[i].get_ro().turn.load(std::memory_order_relaxed);
+    }
+    if (changed > 0) {
+      // A slot the mirror holds an item in is marked dequeued before its
+      // payload is replaced, the primary has dequeued that item already
+      ForEach(first, n, [&](size_t i) {
+        auto& turn = mirror[i].get_rw().turn;
+        auto const old = turn.load(std::memory_order_relaxed);
+        if (old != staged_[i].turn && old % 2 == 1)
+          turn.store(old + 1, std::memory_order_relaxed);
+      });
+      PersistRange(first, n);
+      ForEach(first, n, [&](size_t i) {
+        auto& s = mirror[i].get_rw();
+        if (s.turn.load(std::memory_order_relaxed) != staged_[i].turn)
+          std::memcpy(static_cast<void*>(&s.storage), &staged_[i].storage, sizeof(T));
+      });
+      PersistRange(first, n);
+      ForEach(first, n, [&](size_t i) {
+        mirror[i].get_rw().turn.store(staged_[i].turn, std::memory_order_relaxed);
+      });
+      PersistRange(first, n);
+    }
+
+    // Pushes are replicated up to the first ticket not yet committed, the
+    // slots only tell the last capacity tickets apart
+    auto r = std::max({replicated_.load(std::memory_order_relaxed), begin,
+                       end - std::min(end, cap)});
+    while (r < end && staged_[q_.idx(r)].turn >= q_.turn(r) * 2 + 1)
+      ++r;
+    if (r != mirror_.file_->replicated) {
+      mirror_.file_->replicated = r;
+      mirror_.Persist(&mirror_.file_->replicated, sizeof(mirror_.file_->replicated));
+    }
+    replicated_.store(r, std::memory_order_release);
+    // Pushes from r on and pops from tail on change the slots after this pass
+    from_ = std::min<size_t>(r, tail);
+    return changed > 0;
+  }
+
+  template <typename F>
+  void ForEach(size_t first, size_t n, F&& f) noexcept {
+    for (size_t k = 0; k < n; ++k)
+      f((first + k) % q_.capacity_);
+  }
+
+  // Writes back the mirror slots first to first + n, in at most two ranges
+  void PersistRange(size_t first, size_t n) noexcept {
+    auto* mirror = mirror_.pSlots_;
+    auto const len = std::min(n, q_.capacity_ - first);
+    mirror_.PersistFlush(mirror + first, len * sizeof(PSlot));
+    if (len < n)
+      mirror_.PersistFlush(mirror, (n - len) * sizeof(PSlot));
+    mirror_.PersistDrain();
+  }
+
+  Q& q_;
+  Q mirror_;
+  const std::chrono::microseconds interval_;
+  std::vector<typename Q::VSlot> staged_;
+  // First ticket whose slot may have changed since the last pass
+  size_t from_ = 0;
+  std::atomic<size_t> replicated_{0};
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+} // namespace mpmc
+} // namespace rigtorp
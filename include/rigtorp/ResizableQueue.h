@@ -0,0 +1,369 @@
+/*
+Copyright (c) 2020 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "MPMCQueue.h"
+
+namespace rigtorp {
+namespace mpmc {
+
+/// Volatile queue whose capacity can be changed with resize() while
+/// producers and consumers keep going.
+///
+/// Tickets are taken from one pair of counters for the whole life of the
+/// queue and every ring serves a range of them. resize() closes the current
+/// ring at a cut-over ticket, the larger of head and tail when it runs, and
+/// publishes a new ring that serves the tickets from there on. Operations
+/// holding an earlier ticket finish on the old ring, so the items in it are
+/// still popped first, and later pushes never wait for it to drain. Until it
+/// has drained the queue can hold the items of both rings.
+///
+/// An operation finds its ring after taking its ticket. The cut-over is
+/// marked on the old ring before the counters are read, and the ticket is
+/// taken before the mark is checked, so every operation either has a ticket
+/// below the cut-over or sees the mark and waits the few instructions it
+/// takes resize() to publish the cut-over.
+///
+/// The slots of an old ring are freed once every ticket it serves has been
+/// pushed and popped, which the slot turns show, by the pop that passes the
+/// cut-over or the next resize(). The try_ operations look at a slot before
+/// they own its ticket and pin the ring meanwhile. The small ring headers are
+/// kept until the queue is destroyed.
+template <typename T>
+class ResizableQueue {
+  static constexpr size_t kOpen = std::numeric_limits<size_t>::max();
+  static constexpr size_t kClosing = kOpen - 1;
+
+  struct Ring {
+    Ring(size_t capacity, Ring* prev)
+        : capacity_(capacity), prev_(prev),
+          // Allocate one extra slot to prevent false sharing on the last slot
+          slots_(new Slot<T>[capacity + 1]) {}
+
+    size_t idx(size_t ticket) const noexcept {
+      return (ticket - start_) % capacity_;
+    }
+    size_t turn(size_t ticket) const noexcept {
+      return (ticket - start_) / capacity_;
+    }
+    Slot<T>& slot(size_t ticket) noexcept { return slots_[idx(ticket)]; }
+
+    const size_t capacity_;
+    size_t start_ = 0; // first ticket, set before the ring is published
+    Ring* const prev_;
+    std::unique_ptr<Slot<T>[]> slots_;
+    size_t scanned_ = 0; // slots seen in their final turn, see Reclaim()
+
+    // End of the tickets served, kOpen while this is the current ring
+    alignas(hardwareInterferenceSize) std::atomic<size_t> end_{kOpen};
+    std::atomic<bool> retired_{false};
+    std::atomic<uint32_t> pins_{0};
+  };
+
+public:
+  explicit ResizableQueue(size_t capacity) {
+    if (capacity < 1) {
+      throw std::invalid_argument("capacity < 1");
+    }
+    rings_.push_back(std::make_unique<Ring>(capacity, nullptr));
+    current_.store(rings_.back().get(), std::memory_order_relaxed);
+  }
+
+  // non-copyable and non-movable
+  ResizableQueue(const ResizableQueue&) = delete;
+  ResizableQueue& operator=(const ResizableQueue&) = delete;
+
+  /// Moves the queue to a new ring of the given capacity. Producers and
+  /// consumers are not stopped; throws std::bad_alloc, leaving the queue as
+  /// it was, if the ring cannot be allocated.
+  void resize(size_t capacity) {
+    if (capacity < 1) {
+      throw std::invalid_argument("capacity < 1");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* old = current_.load(std::memory_order_relaxed);
+    auto ring = std::make_unique<Ring>(capacity, old);
+    rings_.reserve(rings_.size() + 1);
+    old->end_.store(kClosing, std::memory_order_seq_cst);
+    auto const cut = std::max(head_.load(std::memory_order_seq_cst),
+                              tail_.load(std::memory_order_seq_cst));
+    ring->start_ = cut;
+    // Publish the new ring before the cut-over, operations with a later
+    // ticket look for it once they see the cut-over
+    current_.store(ring.get(), std::memory_order_release);
+    old->end_.store(cut, std::memory_order_release);
+    rings_.push_back(std::move(ring));
+    Reclaim();
+  }
+
+  /// Capacity of the ring new pushes go to.
+  size_t capacity() const noexcept {
+    return current_.load(std::memory_order_acquire)->capacity_;
+  }
+
+  template <typename... Args>
+  void emplace(Args&&... args) noexcept {
+    static_assert(std::is_nothrow_constructible<T, Args&&...>::value,
+                  "T must be nothrow constructible with Args&&...");
+    auto const head = head_.fetch_add(1);
+    Publish(Find(head), head, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  bool try_emplace(Args&&... args) noexcept {
+    static_assert(std::is_nothrow_constructible<T, Args&&...>::value,
+                  "T must be nothrow constructible with Args&&...");
+    auto head = head_.load(std::memory_order_acquire);
+    for (;;) {
+      auto* r = Pin(head);
+      if (r == nullptr) {
+        head = head_.load(std::memory_order_acquire);
+        continue;
+      }
+      if (r->turn(head) * 2 ==
+          r->slot(head).turn.load(std::memory_order_acquire)) {
+        if (head_.compare_exchange_strong(head, head + 1)) {
+          // A resize may have moved the ticket to the next ring, whose
+          // slot is free as soon as its consumers get there
+          Publish(Find(head), head, std::forward<Args>(args)...);
+          Unpin(r);
+          return true;
+        }
+        Unpin(r);
+      } else {
+        Unpin(r);
+        auto const prevHead = head;
+        head = head_.load(std::memory_order_acquire);
+        if (head == prevHead) {
+          return false;
+        }
+      }
+    }
+  }
+
+  void push(const T& v) noexcept {
+    static_assert(std::is_nothrow_copy_constructible<T>::value,
+                  "T must be nothrow copy constructible");
+    emplace(v);
+  }
+
+  template <typename P,
+            typename = typename std::enable_if<
+                std::is_nothrow_constructible<T, P&&>::value>::type>
+  void push(P&& v) noexcept {
+    emplace(std::forward<P>(v));
+  }
+
+  bool try_push(const T& v) noexcept {
+    static_assert(std::is_nothrow_copy_constructible<T>::value,
+                  "T must be nothrow copy constructible");
+    return try_emplace(v);
+  }
+
+  template <typename P,
+            typename = typename std::enable_if<
+                std::is_nothrow_constructible<T, P&&>::value>::type>
+  bool try_push(P&& v) noexcept {
+    return try_emplace(std::forward<P>(v));
+  }
+
+  void pop(T& v) noexcept {
+    auto const tail = tail_.fetch_add(1);
+    Consume(Find(tail), tail, v);
+  }
+
+  bool try_pop(T& v) noexcept {
+    auto tail = tail_.load(std::memory_order_acquire);
+    for (;;) {
+      auto* r = Pin(tail);
+      if (r == nullptr) {
+        tail = tail_.load(std::memory_order_acquire);
+        continue;
+      }
+      if (r->turn(tail) * 2 + 1 ==
+          r->slot(tail).turn.load(std::memory_order_acquire)) {
+        if (tail_.compare_exchange_strong(tail, tail + 1)) {
+          // The item was pushed to r with this ticket, so r still serves it
+          Consume(r, tail, v);
+          Unpin(r);
+          return true;
+        }
+        Unpin(r);
+      } else {
+        Unpin(r);
+        auto const prevTail = tail;
+        tail = tail_.load(std::memory_order_acquire);
+        if (tail == prevTail) {
+          return false;
+        }
+      }
+    }
+  }
+
+  /// Returns the number of elements in the queue, negative while consumers
+  /// wait. Since this is a concurrent queue the size is only a best effort
+  /// guess until all reader and writer threads have been joined.
+  ptrdiff_t size() const noexcept {
+    return static_cast<ptrdiff_t>(head_.load(std::memory_order_relaxed) -
+                                  tail_.load(std::memory_order_relaxed));
+  }
+
+  bool empty() const noexcept { return size() <= 0; }
+
+  /// Returns the number of old rings whose slots are not freed yet.
+  size_t draining() const noexcept {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n = 0;
+    for (auto& r : rings_)
+      n += r.get() != current_.load(std::memory_order_relaxed) && r->slots_;
+    return n;
+  }
+
+private:
+  // Returns the ring serving ticket, which the caller holds or has pinned
+  Ring* Find(size_t ticket) noexcept {
+    for (;;) {
+      auto* r = current_.load(std::memory_order_acquire);
+      while (ticket < r->start_)
+        r = r->prev_;
+      // Pairs with the cut-over mark in resize(): seq_cst, like the ticket
+      // increment, so one of them sees the other
+      auto const end = r->end_.load(std::memory_order_seq_cst);
+      if (end == kClosing) {
+        std::this_thread::yield();
+      } else if (ticket < end) {
+        return r;
+      }
+      // Otherwise the ring was closed before this ticket, look again
+    }
+  }
+
+  // Pins the ring serving ticket against Reclaim(). Returns nullptr if it is
+  // freed: the ticket is stale.
+  Ring* Pin(size_t ticket) noexcept {
+    auto* r = Find(ticket);
+    r->pins_.fetch_add(1, std::memory_order_seq_cst);
+    if (!r->retired_.load(std::memory_order_seq_cst)) {
+      return r;
+    }
+    Unpin(r);
+    return nullptr;
+  }
+
+  static void Unpin(Ring* r) noexcept {
+    r->pins_.fetch_sub(1, std::memory_order_release);
+  }
+
+  template <typename... Args>
+  void Publish(Ring* r, size_t head, Args&&... args) noexcept {
+    auto& slot = r->slot(head);
+    auto const turn = r->turn(head);
+    while (turn * 2 != slot.turn.load(std::memory_order_acquire))
+      ;
+    slot.construct(std::forward<Args>(args)...);
+    slot.turn.store(turn * 2 + 1, std::memory_order_release);
+  }
+
+  void Consume(Ring* r, size_t tail, T& v) noexcept {
+    auto& slot = r->slot(tail);
+    auto const turn = r->turn(tail);
+    while (turn * 2 + 1 != slot.turn.load(std::memory_order_acquire))
+      ;
+    v = slot.move();
+    slot.destroy();
+    slot.turn.store(turn * 2 + 2, std::memory_order_release);
+    if (tail + 1 >= reclaimAt_.load(std::memory_order_relaxed)) {
+      std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+      if (lock.owns_lock())
+        Reclaim();
+    }
+  }
+
+  // Frees the slots of the old rings whose tickets have all been served.
+  // Called with mutex_ held.
+  void Reclaim() noexcept {
+    auto const head = head_.load(std::memory_order_acquire);
+    auto const tail = tail_.load(std::memory_order_acquire);
+    auto* current = current_.load(std::memory_order_relaxed);
+    size_t next = kOpen;
+    for (auto& ring : rings_) {
+      auto* r = ring.get();
+      if (r == current || !r->slots_)
+        continue;
+      auto const end = r->end_.load(std::memory_order_relaxed);
+      if (!Drained(r, head, tail, end)) {
+        next = std::min(next, end);
+        continue;
+      }
+      // Pairs with Pin(): a try_ operation either sees the ring retired or
+      // is seen here and the slots are freed by a later call
+      r->retired_.store(true, std::memory_order_seq_cst);
+      if (r->pins_.load(std::memory_order_seq_cst) != 0) {
+        next = std::min(next, end);
+        continue;
+      }
+      r->slots_.reset();
+    }
+    reclaimAt_.store(next, std::memory_order_relaxed);
+  }
+
+  // True once every ticket of r has been pushed and popped: the slots have
+  // reached the turn of the last pop of the ring
+  static bool Drained(Ring* r, size_t head, size_t tail, size_t end) noexcept {
+    if (head < end || tail < end)
+      return false;
+    auto const n = end - r->start_;
+    for (; r->scanned_ < r->capacity_; ++r->scanned_) {
+      auto const i = r->scanned_;
+      auto const last = i < n ? ((n - 1 - i) / r->capacity_) * 2 + 2 : 0;
+      if (r->slots_[i].turn.load(std::memory_order_acquire) != last)
+        return false;
+    }
+    return true;
+  }
+
+  mutable std::mutex mutex_; // serializes resize() and Reclaim()
+  std::vector<std::unique_ptr<Ring>> rings_;
+  std::atomic<Ring*> current_{nullptr};
+  // Pops from this ticket on may be able to free an old ring
+  std::atomic<size_t> reclaimAt_{kOpen};
+
+  // Align to avoid false sharing between head_ and tail_
+  alignas(hardwareInterferenceSize) std::atomic<size_t> head_{0};
+  alignas(hardwareInterferenceSize) std::atomic<size_t> tail_{0};
+};
+} // namespace mpmc
+} // namespace rigtorp
@@ -0,0 +1,141 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Per-thread hardware performance counters around a measured region, built
+ * on perf_event_open(2). Every event is opened on its own so that events the
+ * cpu or kernel does not support, or that perf_event_paranoid forbids, are
+ * simply reported as unavailable instead of failing the whole group.
+ */
+
+typedef enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_STALLED_CYCLES,
+  PERF_HITM,
+  PERF_NUM_EVENTS
+} perf_event_t;
+
+typedef struct {
+  int fd[PERF_NUM_EVENTS];
+  /** errno of perf_event_open(2) for unavailable events, 0 if not opened. */
+  int err[PERF_NUM_EVENTS];
+} perf_counters_t;
+
+static const char* const perf_event_names[PERF_NUM_EVENTS] = {
+    "cycles", "instructions", "llc_misses", "stalled_cycles", "hitm",
+};
+
+static int perf_event_attr_init(struct perf_event_attr* attr, int event,
+                                uint64_t hitm_raw) {
+  memset(attr, 0, sizeof(*attr));
+  attr->size = sizeof(*attr);
+  attr->disabled = 1;
+  attr->exclude_kernel = 1;
+  attr->exclude_hv = 1;
+  attr->read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  switch (event) {
+  case PERF_CYCLES:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_CPU_CYCLES;
+    return 0;
+  case PERF_INSTRUCTIONS:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+    return 0;
+  case PERF_LLC_MISSES:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_CACHE_MISSES;
+    return 0;
+  case PERF_STALLED_CYCLES:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_STALLED_CYCLES_BACKEND;
+    return 0;
+  case PERF_HITM:
+    /**
+     * There is no generic HITM event; the raw encoding is model specific,
+     * e.g. 0x04d2 (MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM) on Skylake-SP.
+     */
+    if (hitm_raw == 0)
+      return -1;
+    attr->type = PERF_TYPE_RAW;
+    attr->config = hitm_raw;
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+/**
+ * Opens the counters for the calling thread. Returns the number of events
+ * that could be opened; unavailable events have fd -1 and, if the kernel
+ * refused them, the reason in err.
+ */
+static int perf_open(perf_counters_t* pc, uint64_t hitm_raw) {
+  int n = 0;
+  int i;
+  for (i = 0; i < PERF_NUM_EVENTS; ++i) {
+    struct perf_event_attr attr;
+    pc->fd[i] = -1;
+    pc->err[i] = 0;
+    if (perf_event_attr_init(&attr, i, hitm_raw) != 0)
+      continue;
+    pc->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (pc->fd[i] >= 0)
+      n++;
+    else
+      pc->err[i] = errno;
+  }
+  return n;
+}
+
+static void perf_close(perf_counters_t* pc) {
+  int i;
+  for (i = 0; i < PERF_NUM_EVENTS; ++i) {
+    if (pc->fd[i] >= 0)
+      close(pc->fd[i]);
+    pc->fd[i] = -1;
+  }
+}
+
+static void perf_start(perf_counters_t* pc) {
+  int i;
+  for (i = 0; i < PERF_NUM_EVENTS; ++i) {
+    if (pc->fd[i] >= 0) {
+      ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+/** Stops the counters and stores the counts, scaled for multiplexing. */
+static void perf_stop(perf_counters_t* pc, uint64_t* counts) {
+  int i;
+  for (i = 0; i < PERF_NUM_EVENTS; ++i) {
+    if (pc->fd[i] >= 0)
+      ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+  }
+  for (i = 0; i < PERF_NUM_EVENTS; ++i) {
+    uint64_t buf[3];
+    counts[i] = 0;
+    if (pc->fd[i] < 0 || read(pc->fd[i], buf, sizeof(buf)) != sizeof(buf))
+      continue;
+    if (buf[2] != 0 && buf[2] < buf[1])
+      counts[i] = (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+    else
+      counts[i] = buf[0];
+  }
+}
+
+#endif /* end of include guard: PERFCOUNT_H */
@@ -0,0 +1,76 @@
+#pragma once
+
+// Helpers shared by the test programs in src/
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <system_error>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace rigtorp {
+namespace mpmc {
+namespace testing {
+
+/// Prints whether the check called name passed and returns ok.
+inline bool Check(const char* name, bool ok) {
+  std::cout << name << ": " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+/// A file in the temporary directory, unique to the process, that does not
+/// exist when the TempFile is constructed and is removed with it.
+class TempFile {
+public:
+  explicit TempFile(const std::string& name)
+      : path_((std::filesystem::temp_directory_path() /
+               (name + "." + std::to_string(getpid())))
+                  .string()) {
+    std::filesystem::remove(path_);
+  }
+  ~TempFile() noexcept {
+    std::error_code ec;
+    std::filesystem::remove(path_, ec);
+  }
+  TempFile(const TempFile&) = delete;
+  TempFile& operator=(const TempFile&) = delete;
+
+  const std::string& path() const noexcept { return path_; }
+
+private:
+  std::string path_;
+};
+
+/// Runs f in a child process that exits as if it crashed when f returns:
+/// objects f allocated with new are never destroyed, so their pools and
+/// files are neither closed nor removed. Returns true if f returned.
+template <typename F>
+bool Crash(F&& f) {
+  auto const pid = fork();
+  if (pid == 0) {
+    f();
+    _exit(0);
+  }
+  int status;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+/// Pops n values and checks they count up from first. The queue must hold
+/// them: pop() blocks, and try_pop() of a persistent Queue is not supported.
+template <typename T, typename Q>
+bool PopSequence(Q& q, T first, T n) {
+  bool ok = true;
+  for (T i = first; i < first + n; ++i) {
+    T v{};
+    q.pop(v);
+    ok = ok && v == i;
+  }
+  return ok;
+}
+
+} // namespace testing
+} // namespace mpmc
+} // namespace rigtorp
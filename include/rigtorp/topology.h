@@ -0,0 +1,200 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Runtime CPU topology discovery from /sys/devices/system/cpu and the
+ * pinning policies built on top of it. Unlike the compile-time maps in
+ * cpumap.h these adapt to whatever machine the benchmark runs on.
+ */
+
+#ifndef TOPOLOGY_MAX_CPUS
+#define TOPOLOGY_MAX_CPUS 1024
+#endif
+
+typedef enum {
+  PIN_LEGACY,  /** compile-time cpumap() */
+  PIN_COMPACT, /** fill the physical cores of a socket, then its SMT siblings */
+  PIN_SPREAD,  /** round-robin over sockets, physical cores first */
+  PIN_SMT,     /** fill all hardware threads of a core before the next core */
+  PIN_SOCKET,  /** only the socket the process starts on, cores first */
+} pin_policy_t;
+
+typedef struct {
+  int cpu;
+  int socket;
+  int core;
+  int smt; /** index among the hardware threads of the same core */
+} cpu_info_t;
+
+typedef struct {
+  int ncpus;
+  int nsockets;
+  cpu_info_t cpus[TOPOLOGY_MAX_CPUS];
+  /** cpus in the order threads are assigned to them */
+  int order[TOPOLOGY_MAX_CPUS];
+  int norder;
+} topology_t;
+
+static int topology_read_int(int cpu, const char* file, int* val) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+           cpu, file);
+  FILE* f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  int ret = fscanf(f, "%d", val) == 1 ? 0 : -1;
+  fclose(f);
+  return ret;
+}
+
+static int topology_cmp_core(const void* a, const void* b) {
+  const cpu_info_t* x = (const cpu_info_t*)a;
+  const cpu_info_t* y = (const cpu_info_t*)b;
+  if (x->socket != y->socket)
+    return x->socket - y->socket;
+  if (x->core != y->core)
+    return x->core - y->core;
+  return x->cpu - y->cpu;
+}
+
+/** Sort key of a cpu under policy; smaller keys are used first. */
+static long topology_key(const cpu_info_t* c, pin_policy_t policy, int rank) {
+  long n = TOPOLOGY_MAX_CPUS;
+  switch (policy) {
+  case PIN_COMPACT:
+  case PIN_SOCKET:
+    return ((long)c->socket * n + c->smt) * n + rank;
+  case PIN_SPREAD:
+    return ((long)c->smt * n + rank) * n + c->socket;
+  case PIN_SMT:
+  default:
+    return ((long)c->socket * n + rank) * n + c->smt;
+  }
+}
+
+static long topology_keys[TOPOLOGY_MAX_CPUS];
+
+static int topology_cmp_key(const void* a, const void* b) {
+  long x = topology_keys[*(const int*)a];
+  long y = topology_keys[*(const int*)b];
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Discovers the online cpus and computes the assignment order for policy.
+ * Returns 0 on success and -1 if sysfs is unavailable, in which case the
+ * caller should fall back to cpumap().
+ */
+static int topology_init(topology_t* t, pin_policy_t policy) {
+  memset(t, 0, sizeof(*t));
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return -1;
+
+  int cpu;
+  for (cpu = 0; cpu < TOPOLOGY_MAX_CPUS; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    cpu_info_t* c = &t->cpus[t->ncpus];
+    c->cpu = cpu;
+    if (topology_read_int(cpu, "physical_package_id", &c->socket) != 0 ||
+        topology_read_int(cpu, "core_id", &c->core) != 0)
+      continue;
+    t->ncpus++;
+  }
+
+  if (t->ncpus == 0)
+    return -1;
+
+  /** Number the hardware threads of each core and rank cores per socket. */
+  qsort(t->cpus, t->ncpus, sizeof(cpu_info_t), topology_cmp_core);
+  int ranks[TOPOLOGY_MAX_CPUS];
+  int rank = 0;
+  int i;
+  for (i = 0; i < t->ncpus; ++i) {
+    cpu_info_t* c = &t->cpus[i];
+    if (i > 0 && c->socket == t->cpus[i - 1].socket &&
+        c->core == t->cpus[i - 1].core) {
+      c->smt = t->cpus[i - 1].smt + 1;
+      ranks[i] = ranks[i - 1];
+    } else {
+      if (i == 0 || c->socket != t->cpus[i - 1].socket)
+        rank = 0;
+      c->smt = 0;
+      ranks[i] = rank++;
+    }
+    if (c->socket + 1 > t->nsockets)
+      t->nsockets = c->socket + 1;
+  }
+
+  int home = -1;
+  if (policy == PIN_SOCKET) {
+    int current = sched_getcpu();
+    for (i = 0; i < t->ncpus; ++i) {
+      if (t->cpus[i].cpu == current)
+        home = t->cpus[i].socket;
+    }
+    if (home < 0)
+      home = t->cpus[0].socket;
+  }
+
+  for (i = 0; i < t->ncpus; ++i) {
+    if (home >= 0 && t->cpus[i].socket != home)
+      continue;
+    topology_keys[i] = topology_key(&t->cpus[i], policy, ranks[i]);
+    t->order[t->norder++] = i;
+  }
+  qsort(t->order, t->norder, sizeof(int), topology_cmp_key);
+
+  for (i = 0; i < t->norder; ++i) {
+    t->order[i] = t->cpus[t->order[i]].cpu;
+  }
+
+  return 0;
+}
+
+/** The cpu thread id is pinned to; wraps around when oversubscribed. */
+static int topology_cpumap(const topology_t* t, int id) {
+  return t->order[id % t->norder];
+}
+
+static int topology_parse_policy(const char* name, pin_policy_t* policy) {
+  if (strcmp(name, "legacy") == 0)
+    *policy = PIN_LEGACY;
+  else if (strcmp(name, "compact") == 0)
+    *policy = PIN_COMPACT;
+  else if (strcmp(name, "spread") == 0)
+    *policy = PIN_SPREAD;
+  else if (strcmp(name, "smt") == 0)
+    *policy = PIN_SMT;
+  else if (strcmp(name, "socket") == 0)
+    *policy = PIN_SOCKET;
+  else
+    return -1;
+  return 0;
+}
+
+static const char* topology_policy_name(pin_policy_t policy) {
+  switch (policy) {
+  case PIN_COMPACT:
+    return "compact";
+  case PIN_SPREAD:
+    return "spread";
+  case PIN_SMT:
+    return "smt";
+  case PIN_SOCKET:
+    return "socket";
+  case PIN_LEGACY:
+  default:
+    return "legacy";
+  }
+}
+
+#endif /* end of include guard: TOPOLOGY_H */
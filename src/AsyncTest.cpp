@@ -0,0 +1,120 @@
+#include <pthread.h>
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "rigtorp/AsyncQueue.h"
+
+// Test of AsyncQueue with coroutines. A pipeline of a hundred thousand
+// coroutines on one thread passes items along queues of capacity 1; every
+// push resumes the next stage from inside the previous one, which must not
+// grow the stack with the length of the pipeline: it runs on a thread with a
+// stack too small to nest that many resumes. Then coroutines pop what
+// blocking threads push and the other way round.
+
+namespace {
+using Queue = rigtorp::mpmc::AsyncQueue<uint64_t>;
+
+// Starts right away and frees itself at the end
+struct Task {
+  struct promise_type {
+    Task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+// Moves n items from in to out
+Task Stage(Queue& in, Queue& out, uint64_t n) {
+  for (uint64_t i = 0; i < n; ++i)
+    co_await out.async_push(co_await in.async_pop());
+}
+
+bool Pipeline() {
+  constexpr size_t stages = 100000;
+  constexpr uint64_t n = 10;
+  std::vector<std::unique_ptr<Queue>> queues;
+  for (size_t i = 0; i <= stages; ++i)
+    queues.push_back(std::make_unique<Queue>(1));
+  // Every stage suspends on its first pop
+  for (size_t i = 0; i < stages; ++i)
+    Stage(*queues[i], *queues[i + 1], n);
+  uint64_t sum = 0;
+  for (uint64_t i = 1; i <= n; ++i) {
+    queues.front()->push(i);
+    uint64_t v;
+    queues.back()->pop(v);
+    sum += v;
+  }
+  auto const ok = sum == n * (n + 1) / 2;
+  std::cout << "pipeline: " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+Task Drain(Queue& q, uint64_t n, std::atomic<uint64_t>& sum) {
+  for (uint64_t i = 0; i < n; ++i)
+    sum += co_await q.async_pop();
+}
+
+Task Fill(Queue& q, uint64_t first, uint64_t n) {
+  for (uint64_t i = first; i < first + n; ++i)
+    co_await q.async_push(i);
+}
+
+// Coroutines on this thread against blocking operations on another
+bool Mixed() {
+  constexpr uint64_t n = 100000;
+  constexpr uint64_t coroutines = 4;
+  Queue q(16);
+  std::atomic<uint64_t> sum{0};
+  for (uint64_t c = 0; c < coroutines; ++c)
+    Drain(q, n, sum);
+  std::thread producer([&] {
+    for (uint64_t i = 1; i <= coroutines * n; ++i)
+      q.push(i);
+  });
+  producer.join();
+  auto ok = sum == coroutines * n * (coroutines * n + 1) / 2;
+
+  for (uint64_t c = 0; c < coroutines; ++c)
+    Fill(q, 1 + c * n, n);
+  uint64_t popped = 0;
+  for (uint64_t i = 0; i < coroutines * n; ++i) {
+    uint64_t v;
+    q.pop(v);
+    popped += v;
+  }
+  ok = ok && popped == coroutines * n * (coroutines * n + 1) / 2 && q.empty();
+  std::cout << "mixed: " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+} // namespace
+
+void* RunPipeline(void* ok) {
+  *static_cast<bool*>(ok) = Pipeline();
+  return nullptr;
+}
+
+int main() {
+  bool ok = false;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 256 * 1024);
+  pthread_t thread;
+  if (pthread_create(&thread, &attr, RunPipeline, &ok) != 0) {
+    std::cerr << "pthread_create failed" << std::endl;
+    return 1;
+  }
+  pthread_join(thread, nullptr);
+  pthread_attr_destroy(&attr);
+  ok = Mixed() && ok;
+  return ok ? 0 : 1;
+}
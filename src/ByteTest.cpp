@@ -0,0 +1,175 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rigtorp/ByteQueue.h"
+#include "rigtorp/testing.h"
+
+// Test of ByteQueue. Producers push records of varying length through a
+// small DRAM ring that wraps many times, and consumers check every record
+// arrives once, intact and in order per producer, while releasing them out of
+// order. Then a child process pushes records to a PmemByteQueue, consumes a
+// few and exits without unmapping the file; the parent reopens it and
+// Recover() must restore exactly the records that were not consumed. In a
+// second child one push stalls after reserving its space while later pushes
+// return, and Recover() must keep those.
+
+namespace {
+using namespace rigtorp::mpmc::testing;
+using rigtorp::mpmc::ByteQueue;
+using rigtorp::mpmc::PmemByteQueue;
+using rigtorp::mpmc::PmemByteStorage;
+
+constexpr int kProducers = 2;
+constexpr int kConsumers = 2;
+constexpr uint32_t kRecords = 5000; // per producer, a multiple of kConsumers
+
+// A record is the producer and the sequence number followed by seq % 61
+// bytes of a pattern
+std::vector<std::byte> Encode(uint32_t producer, uint32_t seq) {
+  std::vector<std::byte> r(2 * sizeof(uint32_t) + seq % 61);
+  std::memcpy(r.data(), &producer, sizeof(producer));
+  std::memcpy(r.data() + sizeof(producer), &seq, sizeof(seq));
+  for (size_t i = 2 * sizeof(uint32_t); i < r.size(); ++i)
+    r[i] = static_cast<std::byte>(seq + i);
+  return r;
+}
+
+bool Decode(std::span<const std::byte> r, uint32_t& producer, uint32_t& seq) {
+  if (r.size() < 2 * sizeof(uint32_t))
+    return false;
+  std::memcpy(&producer, r.data(), sizeof(producer));
+  std::memcpy(&seq, r.data() + sizeof(producer), sizeof(seq));
+  auto const expected = Encode(producer, seq);
+  return r.size() == expected.size() &&
+         std::memcmp(r.data(), expected.data(), r.size()) == 0;
+}
+
+bool RoundTrip() {
+  ByteQueue<> q(1024);
+  std::atomic<bool> ok{true};
+  std::vector<std::thread> threads;
+  for (int p = 0; p < kProducers; ++p) {
+    threads.emplace_back([&, p] {
+      for (uint32_t seq = 0; seq < kRecords; ++seq)
+        q.push(Encode(static_cast<uint32_t>(p), seq));
+    });
+  }
+  for (int c = 0; c < kConsumers; ++c) {
+    threads.emplace_back([&] {
+      int64_t last[kProducers];
+      std::fill(std::begin(last), std::end(last), -1);
+      auto check = [&](const auto& r) {
+        uint32_t p, seq;
+        if (!Decode(r.data(), p, seq) || p >= kProducers || seq <= last[p])
+          ok = false;
+        else
+          last[p] = seq;
+      };
+      constexpr uint32_t quota = kProducers * kRecords / kConsumers;
+      for (uint32_t n = 0; n < quota;) {
+        // Release a second record before the first when one is ready. It
+        // must not block: a consumer waiting in pop() while it holds a record
+        // keeps the ring from being reused
+        auto first = q.pop();
+        check(first);
+        if (++n < quota) {
+          if (auto second = q.try_pop()) {
+            check(*second);
+            ++n;
+          }
+        }
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  return Check("round trip", ok && q.empty());
+}
+
+bool Recovery(const std::string& path) {
+  constexpr size_t kCapacity = 4096;
+  constexpr uint32_t kPushed = 40, kConsumed = 15;
+  auto const crashed = Crash([&] {
+    auto* q = new PmemByteQueue(kCapacity, path);
+    for (uint32_t seq = 0; seq < kPushed; ++seq)
+      q->push(Encode(0, seq));
+    for (uint32_t seq = 0; seq < kConsumed; ++seq)
+      q->pop();
+  });
+  if (!crashed)
+    return Check("recovery: child", false);
+
+  PmemByteQueue q(kCapacity, path);
+  q.Recover();
+  bool ok = true;
+  for (uint32_t seq = kConsumed; seq < kPushed; ++seq) {
+    auto r = q.try_pop();
+    uint32_t p, s;
+    ok = ok && r && Decode(r->data(), p, s) && p == 0 && s == seq;
+  }
+  ok = ok && q.empty();
+  // The recovered ring keeps working across the wrap
+  for (uint32_t seq = 0; seq < 1000 && ok; ++seq) {
+    q.push(Encode(1, seq));
+    auto r = q.pop();
+    uint32_t p, s;
+    ok = Decode(r.data(), p, s) && p == 1 && s == seq;
+  }
+  return Check("recovery", ok);
+}
+
+// Never finishes writing back a payload of StallSize bytes, as if the
+// producer crashed between reserving and committing its record
+struct StallingStorage : PmemByteStorage {
+  static constexpr size_t StallSize = 2 * sizeof(uint32_t) + 60;
+  using PmemByteStorage::PmemByteStorage;
+  void flush(const void* addr, size_t len) const noexcept {
+    while (len == StallSize)
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+    PmemByteStorage::flush(addr, len);
+  }
+};
+
+bool Gap(const std::string& path) {
+  constexpr size_t kCapacity = 4096;
+  constexpr uint32_t kBefore = 5, kAfter = 5;
+  auto const crashed = Crash([&] {
+    auto* q = new ByteQueue<StallingStorage>(kCapacity, path);
+    for (uint32_t seq = 0; seq < kBefore; ++seq)
+      q->push(Encode(0, seq));
+    auto const size = q->size();
+    new std::thread([q] { q->push(Encode(1, 60)); });
+    while (q->size() == size)
+      std::this_thread::yield();
+    for (uint32_t seq = kBefore; seq < kBefore + kAfter; ++seq)
+      q->push(Encode(0, seq));
+  });
+  if (!crashed)
+    return Check("gap: child", false);
+
+  PmemByteQueue q(kCapacity, path);
+  q.Recover();
+  bool ok = true;
+  for (uint32_t seq = 0; seq < kBefore + kAfter; ++seq) {
+    auto r = q.try_pop();
+    uint32_t p, s;
+    ok = ok && r && Decode(r->data(), p, s) && p == 0 && s == seq;
+  }
+  return Check("gap", ok && q.empty());
+}
+} // namespace
+
+int main() {
+  TempFile ring("byte_test");
+  bool ok = RoundTrip();
+  ok = Recovery(ring.path()) && ok;
+  TempFile gap("byte_test.gap");
+  ok = Gap(gap.path()) && ok;
+  return ok ? 0 : 1;
+}
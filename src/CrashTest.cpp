@@ -0,0 +1,258 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "rigtorp/MPMCQueue.h"
+
+// Crash injection test for the persistent queue. A child process runs
+// producers and consumers against a file-backed pool and is killed with
+// SIGKILL at a random point. The parent then reopens the pool, recovers the
+// queue and checks every produced value was consumed or recovered exactly
+// once. A process kill keeps everything that reached the page cache, so this
+// exercises Recover() on the states a crashed process leaves behind, not the
+// flush ordering needed to survive a power failure. With "lazy" the queue is
+// recovered with RecoverLazy() and drained while the sweep is still running,
+// with "pmemfile" the queue uses Backend::PmemFile.
+
+namespace {
+using Type = uint64_t;
+using Queue = rigtorp::mpmc::Queue<Type>;
+
+constexpr int MaxProducers = 4;
+constexpr int MaxConsumers = 4;
+constexpr uint64_t MaxPerProducer = 1 << 18;
+constexpr uint64_t MaxPerConsumer = MaxProducers * MaxPerProducer;
+
+// Values are (producer + 1) << 40 | sequence number, so 0 is never pushed
+constexpr Type Encode(int producer, uint64_t seq) {
+  return (static_cast<Type>(producer) + 1) << 40 | seq;
+}
+constexpr int Producer(Type v) { return static_cast<int>(v >> 40) - 1; }
+constexpr uint64_t Seq(Type v) { return v & ((Type{1} << 40) - 1); }
+
+// Progress of the child, in shared memory that outlives it
+struct ProducerLog {
+  std::atomic<uint64_t> acked; // pushes that returned
+};
+struct ConsumerLog {
+  std::atomic<uint64_t> count;  // values logged
+  std::atomic<uint32_t> popping; // inside pop(), value not logged yet
+  Type values[MaxPerConsumer];
+};
+struct Log {
+  std::atomic<uint32_t> ready; // the child has created the pool
+  int producerCount;
+  int consumerCount;
+  ProducerLog producers[MaxProducers];
+  ConsumerLog consumers[MaxConsumers];
+};
+
+[[noreturn]] void RunChild(const std::string& path, size_t capacity,
+                          rigtorp::mpmc::Backend backend, Log* log) {
+  Queue q{capacity, backend, path};
+  log->ready.store(1, std::memory_order_release);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < log->producerCount; ++p) {
+    threads.emplace_back([&, p] {
+      auto& pl = log->producers[p];
+      for (uint64_t seq = 0; seq < MaxPerProducer; ++seq) {
+        q.push(Encode(p, seq));
+        pl.acked.store(seq + 1, std::memory_order_release);
+      }
+    });
+  }
+  for (int c = 0; c < log->consumerCount; ++c) {
+    threads.emplace_back([&, c] {
+      auto& cl = log->consumers[c];
+      for (;;) {
+        cl.popping.store(1, std::memory_order_release);
+        Type v;
+        q.pop(v);
+        auto const n = cl.count.load(std::memory_order_relaxed);
+        cl.values[n] = v;
+        cl.count.store(n + 1, std::memory_order_release);
+        cl.popping.store(0, std::memory_order_release);
+      }
+    });
+  }
+  // Wait for the SIGKILL, the queue destructor must not run
+  for (;;)
+    pause();
+}
+
+struct Result {
+  bool ok;
+  int inFlight;
+  double recoverUs;
+  size_t recovered;
+};
+
+Result Verify(const std::string& path, size_t capacity,
+              rigtorp::mpmc::Backend backend, const Log* log, bool lazy) {
+  const auto producers = static_cast<size_t>(log->producerCount);
+  const auto consumers = static_cast<size_t>(log->consumerCount);
+  // Threads that were inside push() or pop() when the child was killed
+  Result res{true, 0, 0, 0};
+  for (size_t p = 0; p < producers; ++p)
+    res.inFlight += log->producers[p].acked.load() < MaxPerProducer;
+  int popping = 0;
+  for (size_t c = 0; c < consumers; ++c)
+    popping += static_cast<int>(log->consumers[c].popping.load());
+  res.inFlight += popping;
+
+  Queue q{capacity, backend, path};
+  auto const start = std::chrono::steady_clock::now();
+  if (lazy)
+    q.RecoverLazy();
+  else
+    q.Recover();
+  res.recoverUs = std::chrono::duration<double, std::micro>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+  std::vector<std::vector<uint32_t>> seen(producers,
+                                          std::vector<uint32_t>(MaxPerProducer));
+  auto record = [&](Type v, const char* where) {
+    auto const p = Producer(v);
+    auto const seq = Seq(v);
+    if (p < 0 || p >= log->producerCount || seq >= MaxPerProducer) {
+      std::cout << "  corrupt value " << v << " " << where << "\n";
+      res.ok = false;
+    } else if (seq > log->producers[p].acked.load()) {
+      std::cout << "  value " << p << ":" << seq << " " << where
+                << " was never pushed\n";
+      res.ok = false;
+    } else if (seen[static_cast<size_t>(p)][seq]++) {
+      std::cout << "  duplicate " << p << ":" << seq << " " << where << "\n";
+      res.ok = false;
+    }
+  };
+
+  for (size_t c = 0; c < consumers; ++c) {
+    const auto& cl = log->consumers[c];
+    for (uint64_t i = 0; i < cl.count.load(); ++i)
+      record(cl.values[i], "consumed");
+  }
+  if (lazy) {
+    // size() still counts the tickets to skip, drain up to a marker instead.
+    // The queue may be full, so the marker is pushed while draining.
+    std::thread marker([&q] { q.push(Type{0}); });
+    for (;;) {
+      Type v;
+      q.pop(v);
+      if (v == 0)
+        break;
+      record(v, "recovered");
+      ++res.recovered;
+    }
+    marker.join();
+  } else {
+    auto const size = q.size();
+    if (size < 0 || static_cast<size_t>(size) > capacity) {
+      std::cout << "  recovered size " << size << " out of range\n";
+      return {false, res.inFlight, res.recoverUs, 0};
+    }
+    res.recovered = static_cast<size_t>(size);
+    for (ptrdiff_t i = 0; i < size; ++i) {
+      Type v;
+      q.pop(v);
+      record(v, "recovered");
+    }
+  }
+
+  // Every acknowledged push must be accounted for, except values a consumer
+  // had dequeued but not yet logged when it was killed
+  int missing = 0;
+  for (size_t p = 0; p < producers; ++p) {
+    for (uint64_t seq = 0; seq < log->producers[p].acked.load(); ++seq)
+      missing += seen[p][seq] == 0;
+  }
+  if (missing > popping) {
+    std::cout << "  " << missing << " values lost, " << popping
+              << " consumers were inside pop()\n";
+    res.ok = false;
+  }
+  return res;
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+  const std::string dir = argc > 1 ? argv[1] : "/tmp";
+  const int rounds = argc > 2 ? std::atoi(argv[2]) : 5;
+  const auto seed = argc > 3 ? std::strtoul(argv[3], nullptr, 0)
+                             : static_cast<unsigned long>(std::random_device{}());
+  bool lazy = false;
+  auto backend = rigtorp::mpmc::Backend::PmemObj;
+  for (int i = 4; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "lazy")
+      lazy = true;
+    else if (arg == "pmemfile")
+      backend = rigtorp::mpmc::Backend::PmemFile;
+  }
+  const std::string path = dir + "/CrashTest";
+  const std::vector<size_t> capacities{64, 1024, 16 * 1024, 256 * 1024};
+  const std::vector<int> threadCounts{1, 2, 4};
+
+  std::mt19937 rng(static_cast<unsigned>(seed));
+  std::uniform_int_distribution<int> killAfterUs(100, 20000);
+
+  auto* log = static_cast<Log*>(mmap(nullptr, sizeof(Log), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  if (log == MAP_FAILED) {
+    std::cerr << "mmap failed\n";
+    return 1;
+  }
+
+  std::cout << "seed " << seed << ", " << rigtorp::mpmc::backendName(backend)
+            << (lazy ? ", lazy recovery" : "") << "\n";
+  std::cout << "capacity\tthreads\tin-flight\trecovered\trecover-us\tresult\n";
+  int failures = 0;
+  for (auto const capacity : capacities) {
+    for (auto const threads : threadCounts) {
+      for (int round = 0; round < rounds; ++round) {
+        std::filesystem::remove(path);
+        new (log) Log{};
+        log->producerCount = threads;
+        log->consumerCount = threads;
+
+        pid_t pid = fork();
+        if (pid < 0) {
+          std::cerr << "fork failed\n";
+          return 1;
+        }
+        if (pid == 0)
+          RunChild(path, capacity, backend, log);
+
+        while (log->ready.load(std::memory_order_acquire) == 0)
+          std::this_thread::yield();
+        std::this_thread::sleep_for(std::chrono::microseconds(killAfterUs(rng)));
+        kill(pid, SIGKILL);
+        int status;
+        waitpid(pid, &status, 0);
+
+        auto const res = Verify(path, capacity, backend, log, lazy);
+        failures += !res.ok;
+        std::cout << capacity << "\t" << 2 * threads << "\t" << res.inFlight
+                  << "\t" << res.recovered << "\t" << res.recoverUs << "\t"
+                  << (res.ok ? "ok" : "FAILED") << "\n";
+      }
+    }
+  }
+
+  munmap(log, sizeof(Log));
+  std::cout << (failures ? "FAILED" : "PASSED") << "\n";
+  return failures ? 1 : 0;
+}
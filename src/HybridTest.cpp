@@ -0,0 +1,98 @@
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rigtorp/HybridQueue.h"
+#include "rigtorp/testing.h"
+
+// Test of HybridQueue. Producers and consumers run through a small ring while
+// its log wraps many times and every item must arrive once and in order per
+// producer. A queue destroyed with items left must reopen with exactly those
+// items, and after a child process exits without destroying its queue the
+// reopened queue must hold the unpopped items plus the pops since the last
+// persisted watermark, which are delivered again.
+
+namespace {
+using namespace rigtorp::mpmc::testing;
+using Queue = rigtorp::mpmc::HybridQueue<uint64_t>;
+
+constexpr int kProducers = 2;
+constexpr int kConsumers = 2;
+constexpr uint64_t kItems = 2000; // per producer, a multiple of kConsumers
+constexpr size_t kBatch = 4;
+
+// Items are the producer in the high bits and its sequence number from 1
+bool RoundTrip(const std::string& path) {
+  Queue q(8, path, kBatch);
+  std::atomic<uint64_t> sum{0};
+  std::atomic<bool> ordered{true};
+  std::vector<std::thread> threads;
+  for (int p = 0; p < kProducers; ++p) {
+    threads.emplace_back([&, p] {
+      for (uint64_t i = 1; i <= kItems; ++i)
+        q.push(uint64_t(p) << 32 | i);
+    });
+  }
+  for (int c = 0; c < kConsumers; ++c) {
+    threads.emplace_back([&] {
+      uint64_t last[kProducers] = {};
+      uint64_t s = 0, v;
+      for (uint64_t n = 0; n < kProducers * kItems / kConsumers; ++n) {
+        q.pop(v);
+        auto const p = v >> 32, i = v & 0xffffffff;
+        if (i <= last[p])
+          ordered = false;
+        last[p] = i;
+        s += i;
+      }
+      sum += s;
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  auto const ok =
+      sum == kProducers * kItems * (kItems + 1) / 2 && ordered && q.empty();
+  return Check("round trip", ok);
+}
+
+bool Reopen(const std::string& path) {
+  {
+    Queue q(8, path, kBatch);
+    for (uint64_t i = 0; i < 5; ++i)
+      q.push(i);
+    if (!PopSequence<uint64_t>(q, 0, 2))
+      return Check("reopen", false);
+  }
+  Queue q(8, path, kBatch);
+  auto const ok = q.size() == 3 && PopSequence<uint64_t>(q, 2, 3) && q.empty();
+  return Check("reopen", ok);
+}
+
+bool Recovery(const std::string& path) {
+  auto const crashed = Crash([&] {
+    auto* q = new Queue(16, path, kBatch);
+    for (uint64_t i = 0; i < 10; ++i)
+      q->push(i);
+    uint64_t v;
+    for (int i = 0; i < 6; ++i)
+      q->pop(v);
+  });
+  if (!crashed)
+    return Check("recovery: child", false);
+
+  // The watermark was persisted after the 4th pop, the 5th and 6th come back
+  Queue q(16, path, kBatch);
+  auto const ok = q.size() == 6 && PopSequence<uint64_t>(q, 4, 6) && q.empty();
+  return Check("recovery", ok);
+}
+} // namespace
+
+int main() {
+  // A fresh log for each case
+  bool ok = RoundTrip(TempFile("hybrid_test").path());
+  ok = Reopen(TempFile("hybrid_test").path()) && ok;
+  ok = Recovery(TempFile("hybrid_test").path()) && ok;
+  return ok ? 0 : 1;
+}
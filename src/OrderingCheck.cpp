@@ -0,0 +1,401 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "rigtorp/MPMCQueue.h"
+
+// Exhaustive small-scope check of the memory orders of a Queue ordering
+// policy. The ticket protocol of push/pop and try_push/try_pop is modelled
+// step by step, with every atomic operation using the order the policy gives
+// its site, and every interleaving of 2 and 3 threads on queues of capacity 1
+// to 4 is explored.
+//
+// Memory follows the release/acquire view semantics of C++: every location
+// keeps its history of writes, a thread may read any write not older than
+// its view of the location, an acquire load of a release write takes over
+// the view of the writer and a read-modify-write always reads the latest
+// write and continues its release sequence. seq_cst is checked as acq_rel,
+// the queue has no store buffering pattern that needs more. The payload is
+// a plain location: reading it without having seen the write, or writing it
+// without having seen the previous write and read, is a data race.
+//
+// A policy passes if no interleaving races on a payload, loses, duplicates
+// or reorders an item, or deadlocks.
+
+namespace {
+using Order = std::memory_order;
+
+bool isAcquire(Order o) {
+  return o == std::memory_order_consume || o == std::memory_order_acquire ||
+         o == std::memory_order_acq_rel || o == std::memory_order_seq_cst;
+}
+bool isRelease(Order o) {
+  return o == std::memory_order_release || o == std::memory_order_acq_rel ||
+         o == std::memory_order_seq_cst;
+}
+
+constexpr size_t MaxCapacity = 4;
+constexpr size_t MaxThreads = 3;
+// head, tail, then the turn, payload and payload reads of every slot
+constexpr size_t MaxLocs = 2 + 3 * MaxCapacity;
+constexpr size_t Head = 0;
+constexpr size_t Tail = 1;
+
+struct View {
+  std::array<uint8_t, MaxLocs> ts{};
+  void join(const View& o) {
+    for (size_t l = 0; l < MaxLocs; ++l)
+      ts[l] = std::max(ts[l], o.ts[l]);
+  }
+};
+
+struct Message {
+  uint16_t value;
+  View view;
+};
+
+struct Thread {
+  View view;
+  uint8_t pc = 0;
+  uint8_t calls = 0; // operations finished, successful or not
+  uint16_t ticket = 0;
+  uint16_t made = 0; // items pushed by a producer
+};
+
+struct State {
+  std::array<std::vector<Message>, MaxLocs> mem;
+  std::array<Thread, MaxThreads> threads;
+  std::array<std::vector<uint16_t>, MaxThreads> popped;
+
+  std::string key() const {
+    std::string k;
+    auto put = [&k](const void* p, size_t n) {
+      k.append(static_cast<const char*>(p), n);
+    };
+    for (auto const& h : mem) {
+      auto const n = static_cast<uint8_t>(h.size());
+      put(&n, 1);
+      for (auto const& m : h) {
+        put(&m.value, sizeof(m.value));
+        put(m.view.ts.data(), MaxLocs);
+      }
+    }
+    for (auto const& t : threads) {
+      put(t.view.ts.data(), MaxLocs);
+      put(&t.pc, 1);
+      put(&t.calls, 1);
+      put(&t.ticket, sizeof(t.ticket));
+      put(&t.made, sizeof(t.made));
+    }
+    for (auto const& p : popped) {
+      auto const n = static_cast<uint8_t>(p.size());
+      put(&n, 1);
+      put(p.data(), p.size() * sizeof(uint16_t));
+    }
+    return k;
+  }
+};
+
+struct Role {
+  bool producer;
+  bool blocking; // push()/pop(), or try_push()/try_pop()
+  uint8_t calls;
+};
+
+template <typename Ordering>
+class Checker {
+public:
+  Checker(size_t capacity, std::vector<Role> roles)
+      : cap_(capacity), roles_(std::move(roles)) {}
+
+  // Returns the first violation found, or an empty string
+  std::string run() {
+    State s;
+    for (auto& h : s.mem)
+      h.push_back(Message{0, View{}});
+    Explore(s);
+    return error_;
+  }
+
+  size_t states() const { return seen_.size(); }
+
+private:
+  size_t turnLoc(size_t i) const { return 2 + i; }
+  size_t dataLoc(size_t i) const { return 2 + cap_ + i; }
+  size_t readsLoc(size_t i) const { return 2 + 2 * cap_ + i; }
+  size_t idx(size_t t) const { return t % cap_; }
+  uint16_t lap(size_t t) const { return static_cast<uint16_t>(t / cap_); }
+
+  static uint16_t itemOf(size_t thread, size_t k) {
+    return static_cast<uint16_t>((thread + 1) * 64 + k);
+  }
+
+  static void Store(State& s, Thread& th, size_t loc, uint16_t v, Order o,
+                    const View* rmw = nullptr) {
+    auto const ts = static_cast<uint8_t>(s.mem[loc].size());
+    th.view.ts[loc] = ts;
+    View mv{};
+    if (isRelease(o))
+      mv = th.view;
+    mv.ts[loc] = ts;
+    if (rmw != nullptr)
+      mv.join(*rmw);
+    s.mem[loc].push_back(Message{v, mv});
+  }
+
+  static void Load(const State& s, Thread& th, size_t loc, size_t ts, Order o) {
+    th.view.ts[loc] = std::max<uint8_t>(th.view.ts[loc], static_cast<uint8_t>(ts));
+    if (isAcquire(o))
+      th.view.join(s.mem[loc][ts].view);
+  }
+
+  // Calls f(ts) for every write of loc the thread may read
+  template <typename F>
+  static void Readable(const State& s, const Thread& th, size_t loc, F&& f) {
+    for (size_t ts = th.view.ts[loc]; ts < s.mem[loc].size(); ++ts)
+      f(ts);
+  }
+
+  void Explore(const State& s) {
+    if (!error_.empty() || !seen_.insert(s.key()).second)
+      return;
+    bool moved = false, finished = true;
+    for (size_t t = 0; t < roles_.size() && error_.empty(); ++t) {
+      if (s.threads[t].calls == roles_[t].calls)
+        continue;
+      finished = false;
+      moved |= Step(s, t);
+    }
+    if (!error_.empty())
+      return;
+    if (finished)
+      CheckFinal(s);
+    else if (!moved)
+      error_ = "deadlock";
+  }
+
+  // Explores every successor of thread t, returns false if it is blocked
+  bool Step(const State& s, size_t t) {
+    auto const& role = roles_[t];
+    auto const& th = s.threads[t];
+    auto const counter = role.producer ? Head : Tail;
+    // The turn the slot of the ticket must have, and the one it hands over
+    auto const want = static_cast<uint16_t>(lap(th.ticket) * 2 + (role.producer ? 0 : 1));
+    auto const next = static_cast<uint16_t>(want + 1);
+    auto const slot = idx(th.ticket);
+    bool moved = false;
+    auto go = [&](auto&& f) {
+      State n = s;
+      f(n, n.threads[t]);
+      moved = true;
+      Explore(n);
+    };
+
+    switch (th.pc) {
+    case 0:
+      if (role.blocking) {
+        // fetch_add
+        go([&](State& n, Thread& me) {
+          auto const& last = n.mem[counter].back();
+          auto const ts = n.mem[counter].size() - 1;
+          auto const v = last.value;
+          Load(n, me, counter, ts, Ordering::ticket);
+          auto const from = last.view;
+          Store(n, me, counter, static_cast<uint16_t>(v + 1), Ordering::ticket, &from);
+          me.ticket = v;
+          me.pc = 1;
+        });
+      } else {
+        Readable(s, th, counter, [&](size_t ts) {
+          go([&](State& n, Thread& me) {
+            Load(n, me, counter, ts, Ordering::ticketLoad);
+            me.ticket = n.mem[counter][ts].value;
+            me.pc = 1;
+          });
+        });
+      }
+      break;
+    case 1:
+      // Wait for, or with try_*, check the turn
+      Readable(s, th, turnLoc(slot), [&](size_t ts) {
+        auto const v = s.mem[turnLoc(slot)][ts].value;
+        if (role.blocking && v != want)
+          return; // spinning, the read has no effect
+        go([&](State& n, Thread& me) {
+          Load(n, me, turnLoc(slot), ts, Ordering::turnLoad);
+          me.pc = role.blocking ? 3 : (v == want ? 2 : 5);
+        });
+      });
+      break;
+    case 2:
+      // compare_exchange of the ticket
+      go([&](State& n, Thread& me) {
+        auto const ts = n.mem[counter].size() - 1;
+        auto const v = n.mem[counter][ts].value;
+        if (v == me.ticket) {
+          Load(n, me, counter, ts, Ordering::ticketCas);
+          auto const from = n.mem[counter][ts].view;
+          Store(n, me, counter, static_cast<uint16_t>(v + 1), Ordering::ticketCas, &from);
+          me.pc = 3;
+        } else {
+          Load(n, me, counter, ts, std::memory_order_relaxed);
+          me.ticket = v;
+          me.pc = 1;
+        }
+      });
+      break;
+    case 3:
+      // Write or read the payload
+      go([&](State& n, Thread& me) {
+        auto const d = dataLoc(slot);
+        auto const r = readsLoc(slot);
+        if (me.view.ts[d] + 1u != n.mem[d].size() ||
+            (role.producer && me.view.ts[r] + 1u != n.mem[r].size())) {
+          error_ = role.producer ? "data race on push" : "data race on pop";
+          return;
+        }
+        if (role.producer) {
+          Store(n, me, d, itemOf(t, me.made++), std::memory_order_relaxed);
+        } else {
+          n.popped[t].push_back(n.mem[d].back().value);
+          Store(n, me, r, 0, std::memory_order_relaxed);
+        }
+        me.pc = 4;
+      });
+      break;
+    case 4:
+      go([&](State& n, Thread& me) {
+        Store(n, me, turnLoc(slot), next, Ordering::turnStore);
+        me.pc = 0;
+        me.calls++;
+      });
+      break;
+    case 5:
+      // The turn did not match, reload the ticket
+      Readable(s, th, counter, [&](size_t ts) {
+        go([&](State& n, Thread& me) {
+          Load(n, me, counter, ts, Ordering::ticketLoad);
+          auto const v = n.mem[counter][ts].value;
+          if (v == me.ticket) {
+            me.pc = 0; // full or empty
+            me.calls++;
+          } else {
+            me.ticket = v;
+            me.pc = 1;
+          }
+        });
+      });
+      break;
+    }
+    return moved;
+  }
+
+  void CheckFinal(const State& s) {
+    // Items still in the queue, then every item must be accounted for once
+    std::vector<uint16_t> items;
+    for (size_t i = 0; i < cap_; ++i) {
+      if (s.mem[turnLoc(i)].back().value % 2 == 1)
+        items.push_back(s.mem[dataLoc(i)].back().value);
+    }
+    size_t consumers = 0;
+    for (size_t t = 0; t < roles_.size(); ++t) {
+      if (roles_[t].producer)
+        continue;
+      ++consumers;
+      items.insert(items.end(), s.popped[t].begin(), s.popped[t].end());
+    }
+    std::vector<uint16_t> pushed;
+    for (size_t t = 0; t < roles_.size(); ++t) {
+      for (size_t k = 0; roles_[t].producer && k < s.threads[t].made; ++k)
+        pushed.push_back(itemOf(t, k));
+    }
+    std::sort(items.begin(), items.end());
+    if (items != pushed) {
+      error_ = "item lost or duplicated";
+      return;
+    }
+    // A single consumer sees the items of every producer in order
+    if (consumers == 1) {
+      for (size_t t = 0; t < roles_.size(); ++t) {
+        uint16_t last[MaxThreads + 1] = {};
+        for (auto const v : s.popped[t]) {
+          auto& l = last[v / 64];
+          if (v < l)
+            error_ = "items out of order";
+          l = v;
+        }
+      }
+    }
+  }
+
+  const size_t cap_;
+  const std::vector<Role> roles_;
+  std::unordered_set<std::string> seen_;
+  std::string error_;
+};
+
+// A policy that is too weak, the checker must reject it
+struct RelaxedTurnOrdering : rigtorp::mpmc::RelaxedOrdering {
+  static constexpr auto turnLoad = std::memory_order_relaxed;
+};
+
+// Thread layouts: producers and consumers, blocking or try_*, with enough
+// items to wrap around the ring
+std::vector<std::vector<Role>> Layouts(size_t cap) {
+  auto const n = static_cast<uint8_t>(cap + 1);
+  auto const half = static_cast<uint8_t>((n + 1) / 2);
+  auto const rest = static_cast<uint8_t>(n - half);
+  std::vector<std::vector<Role>> layouts;
+  for (bool blocking : {true, false}) {
+    layouts.push_back({{true, blocking, n}, {false, blocking, n}});
+    layouts.push_back({{true, blocking, half}, {true, blocking, rest}, {false, blocking, n}});
+    layouts.push_back({{true, blocking, n}, {false, blocking, half}, {false, blocking, rest}});
+  }
+  return layouts;
+}
+
+std::string Describe(const std::vector<Role>& roles) {
+  size_t p = 0, c = 0;
+  for (auto const& r : roles)
+    (r.producer ? p : c)++;
+  return std::to_string(p) + "P" + std::to_string(c) + "C " +
+         (roles[0].blocking ? "blocking" : "try");
+}
+
+template <typename Ordering>
+bool CheckPolicy(const char* name, bool expectPass) {
+  bool passed = true;
+  for (size_t cap = 1; cap <= MaxCapacity; ++cap) {
+    for (auto const& roles : Layouts(cap)) {
+      Checker<Ordering> checker(cap, roles);
+      auto const error = checker.run();
+      std::cout << name << "\tcapacity " << cap << "\t" << Describe(roles)
+                << "\t" << checker.states() << " states\t"
+                << (error.empty() ? "ok" : error) << "\n";
+      passed &= error.empty();
+    }
+  }
+  if (passed != expectPass) {
+    std::cout << name << (expectPass ? " FAILED" : " was not rejected") << "\n";
+    return false;
+  }
+  return true;
+}
+} // namespace
+
+int main() {
+  bool ok = true;
+  ok &= CheckPolicy<rigtorp::mpmc::DefaultOrdering>("default", true);
+  ok &= CheckPolicy<rigtorp::mpmc::SeqCstOrdering>("seq_cst", true);
+  ok &= CheckPolicy<rigtorp::mpmc::RelaxedOrdering>("relaxed", true);
+  ok &= CheckPolicy<RelaxedTurnOrdering>("relaxed-turn", false);
+  std::cout << (ok ? "PASSED" : "FAILED") << "\n";
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
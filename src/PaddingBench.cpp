@@ -0,0 +1,77 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "rigtorp/MPMCQueue.h"
+
+// Throughput of the volatile queue with its slots and counters padded to
+// 64, 128 and 256 bytes. Every thread pushes and pops in pairs, so
+// neighbouring slots are written by different threads at the same time,
+// which is where a padding smaller than the cpu's false sharing unit shows.
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+  int threads;
+  uint64_t ops; // pairs per thread
+  size_t capacity;
+};
+
+template <size_t Padding>
+void Run(const Config& c) {
+  using Queue = rigtorp::mpmc::Queue<uint64_t,
+                                     rigtorp::mpmc::AlignedAllocator<
+                                         rigtorp::mpmc::Slot<uint64_t>>,
+                                     rigtorp::mpmc::DefaultOrdering, Padding>;
+  Queue q(c.capacity, rigtorp::mpmc::Backend::Volatile);
+  std::atomic<int> ready{0};
+  std::atomic<uint64_t> sum{0};
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < c.threads; ++i) {
+    threads.emplace_back([&] {
+      ++ready;
+      while (ready.load() < c.threads)
+        ;
+      uint64_t s = 0, v;
+      for (uint64_t k = 1; k <= c.ops; ++k) {
+        q.push(k);
+        q.pop(v);
+        s += v;
+      }
+      sum += s;
+    });
+  }
+  auto const start = Clock::now();
+  for (auto& t : threads)
+    t.join();
+  auto const elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  auto const pairs = uint64_t(c.threads) * c.ops;
+  std::cout << Padding << "\t" << sizeof(rigtorp::mpmc::Slot<uint64_t, Padding>)
+            << "\t" << (c.capacity + 1) * sizeof(rigtorp::mpmc::Slot<uint64_t, Padding>) / 1024
+            << "\t" << 2.0 * static_cast<double>(pairs) / elapsed / 1e6 << "\t"
+            << (sum == pairs * (c.ops + 1) / 2 ? "ok" : "BAD") << "\n";
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+  Config c;
+  c.threads = argc > 1 ? std::atoi(argv[1]) : 4;
+  c.ops = argc > 2 ? std::strtoull(argv[2], nullptr, 0) : 1000000;
+  c.capacity = argc > 3 ? std::strtoul(argv[3], nullptr, 0) : 1024;
+
+  std::cout << c.threads << " threads, " << c.ops
+            << " push/pop pairs per thread, capacity " << c.capacity << "\n";
+  std::cout << "padding\tslot-bytes\tring-kib\tmops\tsum\n";
+  Run<64>(c);
+  Run<128>(c);
+  Run<256>(c);
+  return 0;
+}
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "rigtorp/PriorityMPMCQueue.h"
+
+// Latency of control messages while bulk producers keep the queue full.
+// Bulk producers push to the least urgent lane as fast as they can, one
+// producer pushes a timestamped control message to lane 0 at a fixed
+// interval, and the consumers record how long every control message waited.
+// "fifo" runs the same load through a single lane for comparison.
+
+namespace {
+using Clock = std::chrono::steady_clock;
+using Pick = rigtorp::mpmc::Pick;
+
+struct Config {
+  int bulkProducers;
+  int consumers;
+  int ms;
+  size_t capacity;
+  std::chrono::microseconds interval;
+};
+
+int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             Clock::now().time_since_epoch())
+      .count();
+}
+
+double Percentile(const std::vector<int64_t>& sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  auto const i = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1));
+  return static_cast<double>(sorted[i]) / 1000.0;
+}
+
+// Control messages carry their send time, bulk items are 0
+template <size_t K>
+void Run(const char* name, const Config& c, Pick pick,
+         std::array<unsigned, K> weights = {}) {
+  rigtorp::mpmc::PriorityMPMCQueue<int64_t, K> q(c.capacity, pick, weights);
+  std::atomic<bool> stopProducers{false}, stopConsumers{false};
+  std::vector<std::vector<int64_t>> latencies(static_cast<size_t>(c.consumers));
+  std::vector<uint64_t> bulk(static_cast<size_t>(c.consumers));
+
+  std::vector<std::thread> consumers, producers;
+  for (int i = 0; i < c.consumers; ++i) {
+    consumers.emplace_back([&, i] {
+      auto& lat = latencies[static_cast<size_t>(i)];
+      uint64_t n = 0;
+      int64_t v;
+      while (!stopConsumers.load(std::memory_order_relaxed)) {
+        if (!q.try_pop(v))
+          continue;
+        if (v != 0)
+          lat.push_back(Now() - v);
+        else
+          ++n;
+      }
+      bulk[static_cast<size_t>(i)] = n;
+    });
+  }
+  for (int i = 0; i < c.bulkProducers; ++i) {
+    producers.emplace_back([&] {
+      while (!stopProducers.load(std::memory_order_relaxed))
+        q.push(K - 1, int64_t(0));
+    });
+  }
+  producers.emplace_back([&] {
+    auto next = Clock::now();
+    while (!stopProducers.load(std::memory_order_relaxed)) {
+      next += c.interval;
+      while (Clock::now() < next)
+        std::this_thread::yield();
+      q.push(0, Now());
+    }
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(c.ms));
+  // Consumers keep popping until every producer is out of push()
+  stopProducers = true;
+  for (auto& t : producers)
+    t.join();
+  stopConsumers = true;
+  for (auto& t : consumers)
+    t.join();
+
+  std::vector<int64_t> all;
+  uint64_t bulkOps = 0;
+  for (size_t i = 0; i < latencies.size(); ++i) {
+    all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+    bulkOps += bulk[i];
+  }
+  std::sort(all.begin(), all.end());
+  std::cout << name << "\t" << all.size() << "\t" << Percentile(all, 0.5)
+            << "\t" << Percentile(all, 0.99) << "\t" << Percentile(all, 0.999)
+            << "\t" << Percentile(all, 1.0) << "\t"
+            << static_cast<double>(bulkOps) / (c.ms * 1000.0) << "\n";
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+  Config c;
+  c.bulkProducers = argc > 1 ? std::atoi(argv[1]) : 2;
+  c.consumers = argc > 2 ? std::atoi(argv[2]) : 2;
+  c.ms = argc > 3 ? std::atoi(argv[3]) : 1000;
+  c.capacity = argc > 4 ? std::strtoul(argv[4], nullptr, 0) : 1024;
+  c.interval = std::chrono::microseconds(argc > 5 ? std::atoi(argv[5]) : 100);
+
+  std::cout << c.bulkProducers << " bulk producers, " << c.consumers
+            << " consumers, lanes of capacity " << c.capacity
+            << ", a control message every " << c.interval.count() << " us\n";
+  std::cout << "pick\tcontrol-msgs\tp50-us\tp99-us\tp999-us\tmax-us\t"
+               "bulk-mops\n";
+  Run<1>("fifo", c, Pick::Priority);
+  Run<2>("priority", c, Pick::Priority);
+  Run<2>("weighted", c, Pick::Weighted, {1, 4});
+  Run<2>("roundrobin", c, Pick::RoundRobin);
+  return 0;
+}
@@ -0,0 +1,89 @@
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "rigtorp/QueuePool.h"
+#include "rigtorp/testing.h"
+
+// Test of QueuePool: queues of two types share a pool, are reopened from the
+// directory after a clean close and, after a child process pushes to one of
+// them and exits without closing the pool, recovered with RecoverAll(). Every
+// value pushed and not popped must still be in its queue, in order. A queue
+// must not open or be removed as another type, even one of the same size.
+
+namespace {
+using namespace rigtorp::mpmc::testing;
+using rigtorp::mpmc::QueuePool;
+
+constexpr size_t kPoolBytes = 32 << 20;
+
+template <typename F>
+bool Throws(F&& f) {
+  try {
+    f();
+  } catch (const std::invalid_argument&) {
+    return true;
+  }
+  return false;
+}
+
+bool RoundTrip(const std::string& path) {
+  QueuePool pool(path, kPoolBytes, 4);
+  auto a = pool.open<uint64_t>("a", 16);
+  auto b = pool.open<uint32_t>("b", 8);
+  for (uint64_t i = 0; i < 10; ++i)
+    a->push(i);
+  for (uint32_t i = 0; i < 5; ++i)
+    b->push(i);
+  bool ok = PopSequence<uint64_t>(*a, 0, 4) && PopSequence<uint32_t>(*b, 0, 2);
+
+  pool.open<uint64_t>("a-again", 16);
+  ok = ok && Throws([&] { pool.open<uint64_t>("b", 8); }) &&
+       Throws([&] { pool.open<double>("a-again", 16); }) &&
+       Throws([&] { pool.remove<int64_t>("a-again"); });
+  ok = ok && pool.remove<uint64_t>("a-again") &&
+       !pool.remove<uint64_t>("a-again");
+  ok = ok && pool.names() == std::vector<std::string>{"a", "b"};
+  return Check("round trip", ok);
+}
+
+bool Reopen(const std::string& path) {
+  QueuePool pool(path, kPoolBytes);
+  auto a = pool.open<uint64_t>("a", 16);
+  auto b = pool.open<uint32_t>("b", 8);
+  QueuePool::RecoverAll(*a, *b);
+  bool ok = pool.max_queues() == 4 && a->size() == 6 && b->size() == 3;
+  ok = ok && PopSequence<uint64_t>(*a, 4, 1) && PopSequence<uint32_t>(*b, 2, 1);
+  return Check("reopen", ok);
+}
+
+bool Recovery(const std::string& path) {
+  auto const crashed = Crash([&] {
+    auto* pool = new QueuePool(path, kPoolBytes);
+    auto* a = pool->open<uint64_t>("a", 16).release();
+    a->Recover();
+    for (uint64_t i = 10; i < 16; ++i)
+      a->push(i);
+  });
+  if (!crashed)
+    return Check("recovery: child", false);
+
+  QueuePool pool(path, kPoolBytes);
+  auto a = pool.open<uint64_t>("a", 16);
+  auto b = pool.open<uint32_t>("b", 8);
+  QueuePool::RecoverAll(*a, *b);
+  bool ok = a->size() == 11 && b->size() == 2;
+  ok = ok && PopSequence<uint64_t>(*a, 5, 11) && PopSequence<uint32_t>(*b, 3, 2);
+  ok = ok && a->empty() && b->empty();
+  return Check("recovery", ok);
+}
+} // namespace
+
+int main() {
+  TempFile pool("queue_pool_test");
+  bool ok = RoundTrip(pool.path());
+  ok = Reopen(pool.path()) && ok;
+  ok = Recovery(pool.path()) && ok;
+  return ok ? 0 : 1;
+}
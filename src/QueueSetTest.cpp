@@ -0,0 +1,111 @@
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "rigtorp/QueueSet.h"
+#include "rigtorp/testing.h"
+
+// Test of QueueSet: the order in which each Pick serves queues that all have
+// items, and a consumer blocked on an empty set that must be woken by pushes
+// to any of its queues and receive every item once, in order per queue. A
+// queue must not join a second set, and a set must only detach its own
+// notifier when it is destroyed.
+
+namespace {
+using namespace rigtorp::mpmc::testing;
+using rigtorp::mpmc::Pick;
+using Queue = rigtorp::mpmc::Queue<uint64_t>;
+using QueueSet = rigtorp::mpmc::QueueSet<uint64_t>;
+
+constexpr size_t kQueues = 3;
+constexpr uint64_t kItems = 20000; // per queue
+
+// Fills each queue with 4 items and returns the queues popped from in turn
+std::vector<size_t> Order(Pick pick, std::vector<unsigned> weights) {
+  std::vector<std::unique_ptr<Queue>> queues;
+  QueueSet set(pick);
+  for (auto w : weights)
+    set.add(*queues.emplace_back(std::make_unique<Queue>(4, false)), w);
+  for (auto& q : queues)
+    for (uint64_t i = 0; i < 4; ++i)
+      q->push(i);
+  std::vector<size_t> order;
+  uint64_t v;
+  size_t from;
+  while (set.try_pop(v, &from))
+    order.push_back(from);
+  return order;
+}
+
+bool Picks() {
+  bool ok = Order(Pick::RoundRobin, {1, 1, 1}) ==
+            std::vector<size_t>{0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2};
+  ok = ok && Order(Pick::Priority, {1, 1}) ==
+                 std::vector<size_t>{0, 0, 0, 0, 1, 1, 1, 1};
+  // Weights 3:1 while both have items, then the rest of the second queue
+  ok = ok && Order(Pick::Weighted, {3, 1}) ==
+                 std::vector<size_t>{0, 0, 1, 0, 0, 1, 1, 1};
+  return Check("picks", ok);
+}
+
+// Items are the sequence number from 1, one producer per queue
+bool Blocking() {
+  std::vector<std::unique_ptr<Queue>> queues;
+  QueueSet set;
+  for (size_t i = 0; i < kQueues; ++i)
+    set.add(*queues.emplace_back(std::make_unique<Queue>(8, false)));
+
+  std::vector<std::thread> producers;
+  for (auto& q : queues) {
+    producers.emplace_back([q = q.get()] {
+      // Let the consumer block on the empty set first
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      for (uint64_t i = 1; i <= kItems; ++i)
+        q->push(i);
+    });
+  }
+  uint64_t last[kQueues] = {};
+  bool ordered = true;
+  for (uint64_t n = 0; n < kQueues * kItems; ++n) {
+    uint64_t v;
+    size_t from;
+    set.pop(v, &from);
+    ordered = ordered && from < kQueues && v == last[from] + 1;
+    if (from < kQueues)
+      last[from] = v;
+  }
+  for (auto& t : producers)
+    t.join();
+  uint64_t v;
+  return Check("blocking pop", ordered && !set.try_pop(v));
+}
+
+bool Ownership() {
+  Queue q(4, false), other(4, false);
+  rigtorp::mpmc::Notifier n;
+  bool threw = false;
+  {
+    QueueSet first, second;
+    first.add(q);
+    try {
+      second.add(q);
+    } catch (const std::invalid_argument&) {
+      threw = true;
+    }
+    first.add(other);
+    other.set_notifier(&n);
+  }
+  return Check("ownership", threw && q.notifier() == nullptr &&
+                                other.notifier() == &n);
+}
+} // namespace
+
+int main() {
+  bool ok = Picks();
+  ok = Blocking() && ok;
+  ok = Ownership() && ok;
+  return ok ? 0 : 1;
+}
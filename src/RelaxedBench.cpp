@@ -0,0 +1,129 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "rigtorp/RelaxedQueue.h"
+
+// Throughput of the relaxed FIFO mode against the strict queue. Producers
+// push their sequence numbers, consumers pop until they get a stop item and
+// check that the items of every producer arrive in order. "strict" runs
+// the same load through Queue::push() and Queue::pop().
+
+namespace {
+using Clock = std::chrono::steady_clock;
+using Queue = rigtorp::mpmc::Queue<uint64_t>;
+using Relaxed = rigtorp::mpmc::RelaxedQueue<uint64_t>;
+
+struct Config {
+  int producers;
+  int consumers;
+  uint64_t ops; // per producer
+  size_t capacity;
+};
+
+// Items are the producer in the high bits and its sequence number from 1,
+// 0 stops a consumer
+constexpr int kSeqBits = 40;
+
+// Strict and relaxed handles behind one interface
+struct StrictProducer {
+  StrictProducer(Queue& q, Relaxed*) : q_(q) {}
+  void push(uint64_t v) { q_.push(v); }
+  void release() {}
+  Queue& q_;
+};
+
+struct StrictConsumer {
+  StrictConsumer(Queue& q, Relaxed*) : q_(q) {}
+  void pop(uint64_t& v) { q_.pop(v); }
+  void release() {}
+  Queue& q_;
+};
+
+struct RelaxedProducer : Relaxed::Producer {
+  RelaxedProducer(Queue&, Relaxed* r) : Relaxed::Producer(*r) {}
+};
+
+struct RelaxedConsumer : Relaxed::Consumer {
+  RelaxedConsumer(Queue&, Relaxed* r) : Relaxed::Consumer(*r) {}
+};
+
+template <typename P, typename C>
+void Run(const char* name, const Config& c, size_t block) {
+  Queue q(c.capacity, rigtorp::mpmc::Backend::Volatile);
+  Relaxed relaxed(q, block == 0 ? 1 : block);
+  std::atomic<uint64_t> popped{0};
+  std::atomic<bool> ordered{true};
+
+  auto const start = Clock::now();
+  std::vector<std::thread> consumers, producers;
+  for (int i = 0; i < c.consumers; ++i) {
+    consumers.emplace_back([&] {
+      C consumer(q, &relaxed);
+      std::vector<uint64_t> last(static_cast<size_t>(c.producers), 0);
+      uint64_t n = 0, v;
+      for (;;) {
+        consumer.pop(v);
+        if (v == 0)
+          break;
+        auto const p = v >> kSeqBits;
+        auto const seq = v & ((uint64_t(1) << kSeqBits) - 1);
+        if (seq <= last[p])
+          ordered = false;
+        last[p] = seq;
+        ++n;
+      }
+      consumer.release();
+      popped += n;
+    });
+  }
+  for (int i = 0; i < c.producers; ++i) {
+    producers.emplace_back([&, i] {
+      P producer(q, &relaxed);
+      for (uint64_t k = 1; k <= c.ops; ++k)
+        producer.push(uint64_t(i) << kSeqBits | k);
+      producer.release();
+    });
+  }
+  for (auto& t : producers)
+    t.join();
+  // One stop item per consumer, after every item. A consumer waiting on a
+  // ticket past them takes over the tickets a stopped one handed back
+  {
+    P producer(q, &relaxed);
+    for (int i = 0; i < c.consumers; ++i)
+      producer.push(uint64_t(0));
+  }
+  for (auto& t : consumers)
+    t.join();
+  auto const elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  auto const total = uint64_t(c.producers) * c.ops;
+  std::cout << name << "\t" << block << "\t"
+            << static_cast<double>(total) / elapsed / 1e6 << "\t"
+            << (popped == total ? "ok" : "LOST") << "\t"
+            << (ordered ? "ok" : "BROKEN") << "\n";
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+  Config c;
+  c.producers = argc > 1 ? std::atoi(argv[1]) : 4;
+  c.consumers = argc > 2 ? std::atoi(argv[2]) : 4;
+  c.ops = argc > 3 ? std::strtoull(argv[3], nullptr, 0) : 1000000;
+  c.capacity = argc > 4 ? std::strtoul(argv[4], nullptr, 0) : 65536;
+
+  std::cout << c.producers << " producers, " << c.consumers
+            << " consumers, " << c.ops << " items per producer, capacity "
+            << c.capacity << "\n";
+  std::cout << "mode\tblock\tmops\titems\tper-producer-order\n";
+  Run<StrictProducer, StrictConsumer>("strict", c, 0);
+  for (size_t block : {size_t(8), size_t(64), size_t(256)})
+    Run<RelaxedProducer, RelaxedConsumer>("relaxed", c, block);
+  return 0;
+}
@@ -0,0 +1,55 @@
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "rigtorp/Replicator.h"
+#include "rigtorp/testing.h"
+
+// Test of Replicator: a producer and a consumer use a persistent queue while
+// the replicator copies it to a mirror, which wraps the ring many times.
+// Once the replicator is stopped the mirror must have every push and, after
+// the primary is gone, fail over to a queue holding exactly the items the
+// primary still held, in order.
+
+namespace {
+using namespace rigtorp::mpmc::testing;
+using rigtorp::mpmc::Backend;
+using Queue = rigtorp::mpmc::Queue<uint64_t>;
+using Replicator = rigtorp::mpmc::Replicator<uint64_t>;
+
+constexpr size_t kCapacity = 16;
+constexpr uint64_t kPushed = 2000, kPopped = 1990;
+
+bool Run(const std::string& primaryPath, const std::string& mirrorPath) {
+  bool ok = true;
+  {
+    Queue q(kCapacity, Backend::PmemFile, primaryPath);
+    Replicator r(q, mirrorPath, std::chrono::microseconds{10});
+    std::thread producer([&] {
+      for (uint64_t i = 0; i < kPushed; ++i)
+        q.push(i);
+    });
+    uint64_t v;
+    for (uint64_t i = 0; i < kPopped; ++i) {
+      q.pop(v);
+      ok = ok && v == i;
+    }
+    producer.join();
+    r.stop();
+    ok = ok && r.replicated() == kPushed;
+  }
+
+  // Fail over to the mirror
+  Queue mirror(kCapacity, Backend::PmemFile, mirrorPath);
+  mirror.Recover();
+  ok = ok && mirror.size() == kPushed - kPopped &&
+       PopSequence<uint64_t>(mirror, kPopped, kPushed - kPopped);
+  return Check("replicate and fail over", ok && mirror.empty());
+}
+} // namespace
+
+int main() {
+  TempFile primary("replicator_test.primary");
+  TempFile mirror("replicator_test.mirror");
+  return Run(primary.path(), mirror.path()) ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "rigtorp/ResizableQueue.h"
+
+// Stress test of ResizableQueue: producers and consumers run while another
+// thread keeps growing and shrinking the queue. Every item must arrive once,
+// the items of a producer in order at each consumer, and once the threads
+// are joined every old ring must be freed.
+
+namespace {
+using Queue = rigtorp::mpmc::ResizableQueue<uint64_t>;
+
+constexpr int kProducers = 3;
+constexpr int kConsumers = 2;
+constexpr uint64_t kItems = 20000; // per producer, a multiple of kConsumers
+
+// Items are the producer in the high bits and its sequence number from 1
+bool Run(const char* name, bool useTry) {
+  Queue q(4);
+  std::atomic<uint64_t> sum{0};
+  std::atomic<int> running{kConsumers};
+  std::atomic<bool> ordered{true};
+
+  std::vector<std::thread> threads;
+  for (int p = 0; p < kProducers; ++p) {
+    threads.emplace_back([&, p] {
+      for (uint64_t i = 1; i <= kItems; ++i) {
+        auto const v = uint64_t(p) << 32 | i;
+        if (useTry) {
+          while (!q.try_push(v))
+            std::this_thread::yield();
+        } else {
+          q.push(v);
+        }
+      }
+    });
+  }
+  for (int c = 0; c < kConsumers; ++c) {
+    threads.emplace_back([&] {
+      uint64_t last[kProducers] = {};
+      uint64_t s = 0, v;
+      for (uint64_t n = 0; n < kProducers * kItems / kConsumers; ++n) {
+        if (useTry) {
+          while (!q.try_pop(v))
+            std::this_thread::yield();
+        } else {
+          q.pop(v);
+        }
+        auto const p = v >> 32, i = v & 0xffffffff;
+        if (i <= last[p])
+          ordered = false;
+        last[p] = i;
+        s += i;
+      }
+      sum += s;
+      --running;
+    });
+  }
+  std::thread resizer([&] {
+    const size_t capacities[] = {8, 2, 64, 1, 16, 1024, 3};
+    for (size_t k = 0; running.load() > 0; ++k) {
+      q.resize(capacities[k % 7]);
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+  });
+  for (auto& t : threads)
+    t.join();
+  resizer.join();
+  // The queue is empty, the last resize frees every old ring
+  q.resize(32);
+
+  auto const sumOk = sum == kProducers * kItems * (kItems + 1) / 2;
+  auto const ok = sumOk && ordered && q.empty() && q.draining() == 0 &&
+                  q.capacity() == 32;
+  std::cout << name << ": sum " << (sumOk ? "ok" : "BAD") << ", fifo "
+            << (ordered ? "ok" : "BAD") << ", draining " << q.draining()
+            << (ok ? "" : " FAILED") << std::endl;
+  return ok;
+}
+} // namespace
+
+int main() {
+  bool ok = Run("push/pop", false);
+  ok = Run("try_push/try_pop", true) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "rigtorp/MPMCQueue.h"
+
+// Startup latency of persistent queues. Opens a number of queues the way a
+// restarting service does and reports the time to create them, to reopen
+// them after a clean shutdown and to reopen them after a crash, when the
+// pmemobj backend runs the full pool check.
+
+namespace {
+using Queue = rigtorp::mpmc::Queue<uint64_t>;
+using Backend = rigtorp::mpmc::Backend;
+
+std::string PoolPath(const std::string& dir, int i) {
+  return dir + "/StartupBench" + std::to_string(i);
+}
+
+// Opens every queue and closes them again, keeping the pools. Returns the
+// time to open them.
+double OpenAll(const std::string& dir, int queues, size_t capacity,
+               Backend backend) {
+  std::vector<std::unique_ptr<Queue>> qs;
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < queues; ++i)
+    qs.push_back(std::make_unique<Queue>(capacity, backend, PoolPath(dir, i)));
+  auto const end = std::chrono::steady_clock::now();
+  for (auto& q : qs)
+    q->keep_pool(true);
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Opens every queue in a child that exits without closing them, leaving the
+// pools as a crash would
+void Abandon(const std::string& dir, int queues, size_t capacity,
+             Backend backend) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (int i = 0; i < queues; ++i)
+      new Queue(capacity, backend, PoolPath(dir, i));
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+  const std::string dir = argc > 1 ? argv[1] : "/tmp";
+  const int queues = argc > 2 ? std::atoi(argv[2]) : 32;
+  const size_t capacity = argc > 3 ? std::strtoul(argv[3], nullptr, 0) : 1024;
+
+  std::cout << queues << " queues of capacity " << capacity << "\n";
+  std::cout << "backend\tphase\ttotal-ms\tper-queue-ms\n";
+  for (auto const backend : {Backend::PmemObj, Backend::PmemFile}) {
+    for (int i = 0; i < queues; ++i)
+      std::filesystem::remove(PoolPath(dir, i));
+    auto report = [&](const char* phase, double ms) {
+      std::cout << rigtorp::mpmc::backendName(backend) << "\t" << phase << "\t"
+                << ms << "\t" << ms / queues << "\n";
+    };
+    report("create", OpenAll(dir, queues, capacity, backend));
+    report("clean-open", OpenAll(dir, queues, capacity, backend));
+    Abandon(dir, queues, capacity, backend);
+    report("crash-open", OpenAll(dir, queues, capacity, backend));
+    for (int i = 0; i < queues; ++i)
+      std::filesystem::remove(PoolPath(dir, i));
+  }
+  return 0;
+}
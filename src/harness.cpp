@@ -3,13 +3,17 @@
 #include "../include/rigtorp/bits.h"
 #include "../include/rigtorp/cpumap.h"
 #include "../include/rigtorp/delay.h"
+#include "../include/rigtorp/perfcount.h"
+#include "../include/rigtorp/topology.h"
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -34,18 +38,103 @@ static long nops;
 #define COV_THRESHOLD 0.02
 #endif
 
-// #define SZ 10'000'000
+#ifndef MAX_SWEEP
+#define MAX_SWEEP 64
+#endif
+
+/** Queue capacity, make SZ=10000000 for a ring larger than the caches. */
+#ifndef SZ
 #define SZ 10'000
+#endif
 
 static pthread_barrier_t barrier;
+static pthread_barrier_t pool_barrier;
 static double times[MAX_ITERS];
 static double means[MAX_ITERS];
 static double covs[MAX_ITERS];
 static volatile int target;
 
+/** Thread count of the current sweep point, read by the pooled threads. */
+static volatile int round_nprocs;
+static volatile int done;
+static void* results[MAX_PROCS];
+
+/** Progress output; stdout for text results, stderr for CSV/JSON. */
+static FILE* out;
+
+static pin_policy_t pin_policy = PIN_LEGACY;
+static topology_t topology;
+
+/** Hardware counters, summed over threads for every iteration. */
+static int perf_enabled;
+static uint64_t perf_hitm_raw;
+static int perf_available[PERF_NUM_EVENTS];
+/** Why an event is unavailable, see perf_counters_t::err. */
+static int perf_errno[PERF_NUM_EVENTS];
+static uint64_t perf_thread[MAX_PROCS][PERF_NUM_EVENTS];
+static uint64_t perf_iter[MAX_ITERS][PERF_NUM_EVENTS];
+
+/** Time to create or open the pool and map the slots. */
+static long open_us;
+
+/** Results carry the flush strategy when --flush is given. */
+static int flush_column;
+
+/** Results carry the ticket aggregation when --aggregate is given. */
+static int aggregate_column;
+
+/** Results carry the elimination cells when --elim is given. */
+static int elim_column;
+
+/** Results carry the prefetch distance when --prefetch is given. */
+static int prefetch_column;
+
+/** Persistence cost breakdown of every thread, see MPMC_PERSIST_PROFILE. */
+static rigtorp::mpmc::PersistProfile persist_profiles[MAX_PROCS];
+
+enum format_t { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON };
+
+struct summary_t {
+  rigtorp::mpmc::FlushStrategy flush;
+  /** Cpus per ticket aggregation group, 0 without aggregation. */
+  int aggregate;
+  /** Cells of the elimination array, 0 without elimination. */
+  int elim;
+  /** Tickets ahead whose slot is prefetched, 0 without prefetching. */
+  int prefetch;
+  int nprocs;
+  int first;
+  int last;
+  double mean;
+  double cov;
+  double ci95;
+  /** Per-op counter values over the steady-state window, < 0 if n/a. */
+  double perf[PERF_NUM_EVENTS];
+};
+
+/** Two-sided 95% Student's t quantiles, indexed by degrees of freedom - 1. */
+static const double T95[] = {
+    12.71, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
 const char* PoolPath = "/mnt/pmem0/myrontsa/MPMC";
-rigtorp::MPMCQueue<void*> q(SZ, true, PoolPath);
-// rigtorp::MPMCQueue<void*> q(SZ, false);
+// Memory ordering policy of the queue, see make ORDERING=relaxed|seq_cst
+#ifndef MPMC_ORDERING
+#define MPMC_ORDERING DefaultOrdering
+#endif
+// Alignment of the slots and counters, see make PADDING=64|128|256
+#ifndef MPMC_PADDING
+#define MPMC_PADDING rigtorp::mpmc::hardwareInterferenceSize
+#endif
+#define STR_(x) #x
+#define STR(x) STR_(x)
+using Queue = rigtorp::MPMCQueue<void*, rigtorp::mpmc::AlignedAllocator<rigtorp::mpmc::Slot<void*>>,
+                                 rigtorp::mpmc::MPMC_ORDERING, MPMC_PADDING>;
+static std::unique_ptr<Queue> q;
+static std::unique_ptr<rigtorp::mpmc::TicketAggregator> aggregator;
+static std::unique_ptr<rigtorp::mpmc::EliminationArray<void*>> elimination;
 
 static size_t elapsed_time(size_t us) {
   struct timeval t;
@@ -80,6 +169,25 @@ static double compute_cov(const double* times, double mean) {
   return cov;
 }
 
+/** Half-width of the 95% confidence interval of the mean. */
+static double compute_ci95(const double* times, double mean) {
+  if (NUM_ITERS < 2)
+    return 0;
+
+  double variance = 0;
+
+  int i;
+  for (i = 0; i < NUM_ITERS; ++i) {
+    variance += (times[i] - mean) * (times[i] - mean);
+  }
+
+  variance /= NUM_ITERS - 1;
+
+  int dof = NUM_ITERS - 1;
+  double t = dof <= (int)(sizeof(T95) / sizeof(T95[0])) ? T95[dof - 1] : 1.96;
+  return t * sqrt(variance) / sqrt(NUM_ITERS);
+}
+
 static size_t reduce_min(long val, int id, int nprocs) {
   static long buffer[MAX_PROCS];
 
@@ -100,8 +208,17 @@ static void report(int id, int nprocs, int i, long us) {
   long ms = reduce_min(us, id, nprocs);
 
   if (id == 0) {
+    if (perf_enabled) {
+      int e, t;
+      for (e = 0; e < PERF_NUM_EVENTS; ++e) {
+        perf_iter[i][e] = 0;
+        for (t = 0; t < nprocs; ++t)
+          perf_iter[i][e] += perf_thread[t][e];
+      }
+    }
+
     times[i] = ms / 1000.0;
-    printf("  #%d elapsed time: %.2f ms\n", i + 1, times[i]);
+    fprintf(out, "  #%d elapsed time: %.2f ms\n", i + 1, times[i]);
 
     if (i + 1 >= NUM_ITERS) {
       int n = i + 1 - NUM_ITERS;
@@ -119,6 +236,7 @@ static void report(int id, int nprocs, int i, long us) {
 }
 
 #include <iostream>
+#include <vector>
 void* benchmark(int id, int nprocs) {
   void* val = (void*)(intptr_t)(id + 1);
   delay_t state;
@@ -126,10 +244,10 @@ void* benchmark(int id, int nprocs) {
 
   int i;
   for (i = 0; i < nops / nprocs; ++i) {
-    q.push(val);
+    q->push(val);
     delay_exec(&state);
 
-    q.pop(val);
+    q->pop(val);
     delay_exec(&state);
   }
 
@@ -149,7 +267,7 @@ void init(int nprocs, int logn) {
     nops *= 10;
   }
 
-  printf("  Number of operations: %ld\n", nops);
+  fprintf(out, "  Number of operations: %ld\n", nops);
 }
 
 void thread_init(int id, int nprocs) { ; }
@@ -180,60 +298,520 @@ int verify(int nprocs, void** results) {
   }
 
   if (ret != 1) {
-    fprintf(stdout, "PASSED\n");
-    puts("Printing array --> ");
+    fprintf(out, "PASSED\n");
+    fputs("Printing array --> \n", out);
     for (int k = 0; k < nprocs; k++) {
       int res = (int)(intptr_t)results[k];
-      printf("%d\n", res);
+      fprintf(out, "%d\n", res);
     }
 
   } else {
-    puts("Printing array --> ");
+    fputs("Printing array --> \n", out);
     for (int k = 0; k < nprocs; k++) {
       int res = (int)(intptr_t)results[k];
-      printf("%d\n", res);
+      fprintf(out, "%d\n", res);
     }
   }
   return ret;
 #endif
 }
 
-static void* thread(void* bits) {
-  int id = bits_hi(bits);
-  int nprocs = bits_lo(bits);
+/** Runs the measured iterations of one sweep point on thread id. */
+static void* run(int id, int nprocs, perf_counters_t* pc) {
+  int i;
+  void* result = NULL;
 
+  rigtorp::mpmc::persistProfile() = {};
+
+  for (i = 0; i < MAX_ITERS && target == 0; ++i) {
+    if (perf_enabled)
+      perf_start(pc);
+    long us = elapsed_time(0);
+    result = benchmark(id, nprocs);
+    if (perf_enabled)
+      perf_stop(pc, perf_thread[id]);
+    pthread_barrier_wait(&barrier);
+    us = elapsed_time(us);
+    report(id, nprocs, i, us);
+  }
+
+  persist_profiles[id] = rigtorp::mpmc::persistProfile();
+  return result;
+}
+
+/** An event is reported only if every thread could open it. */
+static void perf_open_thread(perf_counters_t* pc) {
+  int e;
+  if (!perf_enabled) {
+    for (e = 0; e < PERF_NUM_EVENTS; ++e)
+      pc->fd[e] = -1;
+    return;
+  }
+  perf_open(pc, perf_hitm_raw);
+  for (e = 0; e < PERF_NUM_EVENTS; ++e) {
+    if (pc->fd[e] < 0) {
+      __atomic_store_n(&perf_available[e], 0, __ATOMIC_RELAXED);
+      if (pc->err[e] != 0)
+        __atomic_store_n(&perf_errno[e], pc->err[e], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void pin(int id, int nprocs) {
   cpu_set_t set;
   CPU_ZERO(&set);
 
-  int cpu = cpumap(id, nprocs);
+  int cpu = pin_policy == PIN_LEGACY ? cpumap(id, nprocs)
+                                     : topology_cpumap(&topology, id);
   CPU_SET(cpu, &set);
   sched_setaffinity(0, sizeof(set), &set);
+}
 
+/**
+ * Pooled worker. Threads are created and pinned once and then take part in
+ * every sweep point whose thread count exceeds their id.
+ */
+static void* thread(void* bits) {
+  int id = bits_hi(bits);
+  int nprocs = bits_lo(bits);
+
+  pin(id, nprocs);
   thread_init(id, nprocs);
-  pthread_barrier_wait(&barrier);
 
-  int i;
-  void* result = NULL;
+  perf_counters_t pc;
+  perf_open_thread(&pc);
 
-  for (i = 0; i < MAX_ITERS && target == 0; ++i) {
-    long us = elapsed_time(0);
-    result = benchmark(id, nprocs);
-    pthread_barrier_wait(&barrier);
-    us = elapsed_time(us);
-    report(id, nprocs, i, us);
+  for (;;) {
+    pthread_barrier_wait(&pool_barrier);
+    if (done)
+      break;
+    if (id < round_nprocs)
+      results[id] = run(id, round_nprocs, &pc);
+    pthread_barrier_wait(&pool_barrier);
   }
 
+  perf_close(&pc);
   thread_exit(id, nprocs);
-  return result;
+  return NULL;
+}
+
+/** Picks the steady-state window of the last sweep point. */
+static struct summary_t summarize(int nprocs) {
+  if (target == 0) {
+    target = NUM_ITERS - 1;
+    double minCov = covs[target];
+
+    /** Pick the result that has the lowest CoV. */
+    int i;
+    for (i = NUM_ITERS; i < MAX_ITERS; ++i) {
+      if (covs[i] < minCov) {
+        minCov = covs[i];
+        target = i;
+      }
+    }
+  }
+
+  struct summary_t s;
+  s.nprocs = nprocs;
+  s.first = target - NUM_ITERS + 2;
+  s.last = target + 1;
+  s.mean = means[target];
+  s.cov = covs[target];
+  s.ci95 = compute_ci95(times + target + 1 - NUM_ITERS, s.mean);
+
+  double ops = 2.0 * (double)(nops / nprocs * nprocs) * NUM_ITERS;
+  int e, i;
+  for (e = 0; e < PERF_NUM_EVENTS; ++e) {
+    s.perf[e] = -1;
+    if (!perf_enabled || !perf_available[e])
+      continue;
+    double sum = 0;
+    for (i = target + 1 - NUM_ITERS; i <= target; ++i)
+      sum += (double)perf_iter[i][e];
+    s.perf[e] = sum / ops;
+  }
+  return s;
+}
+
+static void print_persist_op(const char* name,
+                             const rigtorp::mpmc::PersistOpProfile* p) {
+  double ops = p->ops ? (double)p->ops : 1;
+  fprintf(out,
+          " %s wait %.1f copy %.1f flush %.1f fence %.1f bytes %.1f", name,
+          p->waitCycles / ops, p->copyCycles / ops, p->flushCycles / ops,
+          p->fenceCycles / ops, p->bytesFlushed / ops);
+}
+
+/**
+ * Per-thread and total persistence cost per op in cycles, over all
+ * iterations of the last sweep point.
+ */
+static void print_persist_profile(int nprocs) {
+  if (!rigtorp::mpmc::persistProfileEnabled || !q->is_persistent())
+    return;
+
+  rigtorp::mpmc::PersistProfile total = {};
+  int i;
+  for (i = 0; i <= nprocs; ++i) {
+    const rigtorp::mpmc::PersistProfile* p = &total;
+    if (i < nprocs) {
+      p = &persist_profiles[i];
+      rigtorp::mpmc::PersistOpProfile* ops[] = {&total.push, &total.pop};
+      const rigtorp::mpmc::PersistOpProfile* src[] = {&p->push, &p->pop};
+      int k;
+      for (k = 0; k < 2; ++k) {
+        ops[k]->ops += src[k]->ops;
+        ops[k]->waitCycles += src[k]->waitCycles;
+        ops[k]->copyCycles += src[k]->copyCycles;
+        ops[k]->flushCycles += src[k]->flushCycles;
+        ops[k]->fenceCycles += src[k]->fenceCycles;
+        ops[k]->bytesFlushed += src[k]->bytesFlushed;
+      }
+      fprintf(out, "  Persist profile thread %d:", i);
+    } else {
+      fprintf(out, "  Persist profile total:");
+    }
+    print_persist_op("push", &p->push);
+    fprintf(out, " |");
+    print_persist_op("pop", &p->pop);
+    fprintf(out, "\n");
+  }
+}
+
+static void print_text(const struct summary_t* s) {
+  printf("  Steady-state iterations: %d~%d\n", s->first, s->last);
+  printf("  Coefficient of variation: %.2f\n", s->cov);
+  printf("  Number of measurements: %d\n", NUM_ITERS);
+  printf("  95%% confidence interval: +/- %.2f ms\n", s->ci95);
+  if (perf_enabled) {
+    printf("  Per-op counters:");
+    int e;
+    for (e = 0; e < PERF_NUM_EVENTS; ++e) {
+      if (s->perf[e] < 0)
+        printf(" %s n/a", perf_event_names[e]);
+      else
+        printf(" %s %.2f", perf_event_names[e], s->perf[e]);
+    }
+    printf("\n");
+  }
+  printf("  Mean of elapsed time: %.2f ms\n", s->mean);
+  printf("===========================================\n");
+}
+
+/** Million queue operations (one push plus one pop per op) per second. */
+static double mops(const struct summary_t* s) {
+  return 2.0 * (double)(nops / s->nprocs * s->nprocs) / (s->mean * 1000.0);
+}
+
+static void print_csv(const struct summary_t* s, int n) {
+  int e, i;
+  if (flush_column)
+    printf("flush,");
+  if (aggregate_column)
+    printf("aggregate,");
+  if (elim_column)
+    printf("elim,");
+  if (prefetch_column)
+    printf("prefetch,");
+  printf("threads,ops,first_iter,last_iter,mean_ms,cov,ci95_ms,mops");
+  for (e = 0; perf_enabled && e < PERF_NUM_EVENTS; ++e)
+    printf(",%s_per_op", perf_event_names[e]);
+  printf("\n");
+  for (i = 0; i < n; ++i) {
+    if (flush_column)
+      printf("%s,", rigtorp::mpmc::flushStrategyName(s[i].flush));
+    if (aggregate_column)
+      printf("%d,", s[i].aggregate);
+    if (elim_column)
+      printf("%d,", s[i].elim);
+    if (prefetch_column)
+      printf("%d,", s[i].prefetch);
+    printf("%d,%ld,%d,%d,%.4f,%.4f,%.4f,%.4f", s[i].nprocs, nops,
+           s[i].first, s[i].last, s[i].mean, s[i].cov, s[i].ci95,
+           mops(&s[i]));
+    for (e = 0; perf_enabled && e < PERF_NUM_EVENTS; ++e) {
+      if (s[i].perf[e] < 0)
+        printf(",");
+      else
+        printf(",%.4f", s[i].perf[e]);
+    }
+    printf("\n");
+  }
+}
+
+static void print_json(const char* name, const struct summary_t* s, int n) {
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+
+  printf("{\n");
+  printf("  \"benchmark\": \"%s\",\n", name);
+  printf("  \"host\": \"%s\",\n", host);
+  printf("  \"persistent\": %s,\n", q->is_persistent() ? "true" : "false");
+  printf("  \"backend\": \"%s\",\n", rigtorp::mpmc::backendName(q->backend()));
+  printf("  \"open_ms\": %.3f,\n", open_us / 1000.0);
+  printf("  \"pin\": \"%s\",\n", topology_policy_name(pin_policy));
+  printf("  \"capacity\": %d,\n", SZ);
+  printf("  \"ops\": %ld,\n", nops);
+  printf("  \"measurements\": %d,\n", NUM_ITERS);
+  printf("  \"results\": [\n");
+  int e, i;
+  for (i = 0; i < n; ++i) {
+    printf("    {");
+    if (flush_column)
+      printf("\"flush\": \"%s\", ",
+             rigtorp::mpmc::flushStrategyName(s[i].flush));
+    if (aggregate_column)
+      printf("\"aggregate\": %d, ", s[i].aggregate);
+    if (elim_column)
+      printf("\"elim\": %d, ", s[i].elim);
+    if (prefetch_column)
+      printf("\"prefetch\": %d, ", s[i].prefetch);
+    printf("\"threads\": %d, \"first_iter\": %d, \"last_iter\": %d, "
+           "\"mean_ms\": %.4f, \"cov\": %.4f, \"ci95_ms\": %.4f, "
+           "\"mops\": %.4f",
+           s[i].nprocs, s[i].first, s[i].last, s[i].mean, s[i].cov,
+           s[i].ci95, mops(&s[i]));
+    for (e = 0; perf_enabled && e < PERF_NUM_EVENTS; ++e) {
+      if (s[i].perf[e] < 0)
+        printf(", \"%s_per_op\": null", perf_event_names[e]);
+      else
+        printf(", \"%s_per_op\": %.4f", perf_event_names[e], s[i].perf[e]);
+    }
+    printf("}%s\n", i + 1 < n ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+/** Parses a colon separated thread list such as 1:2:4:8. */
+static int parse_threads(const char* s, int* sweep) {
+  int n = 0;
+  while (*s && n < MAX_SWEEP) {
+    char* end;
+    long v = strtol(s, &end, 10);
+    if (end == s || v <= 0 || v > MAX_PROCS)
+      return -1;
+    sweep[n++] = (int)v;
+    s = *end == ':' ? end + 1 : end;
+    if (*end != ':' && *end != '\0')
+      return -1;
+  }
+  return n;
+}
+
+/** Flush strategies the --flush option can name, "all" selects every one. */
+static const rigtorp::mpmc::FlushStrategy FLUSH_STRATEGIES[] = {
+    rigtorp::mpmc::FlushStrategy::Auto,
+    rigtorp::mpmc::FlushStrategy::Pool,
+    rigtorp::mpmc::FlushStrategy::Clwb,
+    rigtorp::mpmc::FlushStrategy::ClflushOpt,
+    rigtorp::mpmc::FlushStrategy::Clflush,
+    rigtorp::mpmc::FlushStrategy::NonTemporal,
+};
+#define NUM_FLUSH_STRATEGIES \
+  (int)(sizeof(FLUSH_STRATEGIES) / sizeof(FLUSH_STRATEGIES[0]))
+
+/**
+ * Parses a colon separated list of flush strategies such as clwb:nt. "all"
+ * selects the strategies the cpu supports.
+ */
+static int parse_flush(const char* s, rigtorp::mpmc::FlushStrategy* flush) {
+  int n = 0, k;
+  if (strcmp(s, "all") == 0) {
+    for (k = 0; k < NUM_FLUSH_STRATEGIES; ++k) {
+      if (rigtorp::mpmc::flushStrategySupported(FLUSH_STRATEGIES[k]))
+        flush[n++] = FLUSH_STRATEGIES[k];
+    }
+    return n;
+  }
+  while (*s && n < NUM_FLUSH_STRATEGIES) {
+    size_t len = strcspn(s, ":");
+    for (k = 0; k < NUM_FLUSH_STRATEGIES; ++k) {
+      const char* name = rigtorp::mpmc::flushStrategyName(FLUSH_STRATEGIES[k]);
+      if (strlen(name) == len && strncmp(s, name, len) == 0)
+        break;
+    }
+    if (k == NUM_FLUSH_STRATEGIES)
+      return -1;
+    flush[n++] = FLUSH_STRATEGIES[k];
+    s += len;
+    if (*s == ':')
+      s++;
+  }
+  return n;
+}
+
+/** Most settings --aggregate, --elim and --prefetch can compare. */
+#define MAX_SETTINGS 4
+
+/**
+ * Parses a colon separated list of sizes such as off:8:16 for --aggregate,
+ * --elim and --prefetch, "off" is 0.
+ */
+static int parse_settings(const char* s, int* settings) {
+  int n = 0;
+  while (*s && n < MAX_SETTINGS) {
+    char* end;
+    long v = 0;
+    if (strncmp(s, "off", 3) == 0) {
+      end = (char*)s + 3;
+    } else {
+      v = strtol(s, &end, 10);
+      if (end == s || v < 0 || v > MAX_PROCS)
+        return -1;
+    }
+    settings[n++] = (int)v;
+    if (*end != ':' && *end != '\0')
+      return -1;
+    s = *end == ':' ? end + 1 : end;
+  }
+  return *s ? -1 : n;
+}
+
+static int parse_backend(const char* s, rigtorp::mpmc::Backend* backend) {
+  const rigtorp::mpmc::Backend backends[] = {
+      rigtorp::mpmc::Backend::Volatile,
+      rigtorp::mpmc::Backend::PmemObj,
+      rigtorp::mpmc::Backend::PmemFile,
+  };
+  int k;
+  for (k = 0; k < 3; ++k) {
+    if (strcmp(s, rigtorp::mpmc::backendName(backends[k])) == 0) {
+      *backend = backends[k];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [nprocs] [logn] [options]\n"
+          "  --threads=N1:N2:...  sweep thread counts in one process\n"
+          "  --format=text|csv|json\n"
+          "  --pool=PATH          persistent pool location (default %s)\n"
+          "  --volatile           use the volatile queue\n"
+          "  --backend=volatile|pmemobj|pmemfile\n"
+          "                       where the slots live (default pmemobj)\n"
+          "  --flush=S1:S2:...|all\n"
+          "                       persistent flush strategies to sweep: auto,\n"
+          "                       pool, clwb, clflushopt, clflush, nt\n"
+          "  --aggregate[=N1:N2:...]\n"
+          "                       combine the tickets of N consecutive cpus\n"
+          "                       (default 8), off or 0 compares without\n"
+          "  --elim[=N1:N2:...]   pair pushes and pops of the volatile queue\n"
+          "                       in N elimination cells (default 8)\n"
+          "  --prefetch=D1:D2:...\n"
+          "                       prefetch the slot D tickets ahead, off or\n"
+          "                       0 compares without (default off)\n"
+          "  --pin=legacy|compact|spread|smt|socket\n"
+          "                       cpu pinning policy (default: compile-time "
+          "cpumap)\n"
+          "  --perf               collect per-op hardware counters\n"
+          "  --perf-hitm=RAW      raw perf event encoding used for HITM\n",
+          prog, PoolPath);
 }
 
 int main(int argc, const char* argv[]) {
   int nprocs = 0;
   int n = 0;
+  int sweep[MAX_SWEEP];
+  int nsweep = 0;
+  int format = FORMAT_TEXT;
+  rigtorp::mpmc::FlushStrategy flush[NUM_FLUSH_STRATEGIES];
+  int nflush = 0;
+  int aggregate[MAX_SETTINGS];
+  int naggregate = 0;
+  int elim[MAX_SETTINGS];
+  int nelim = 0;
+  int prefetch[MAX_SETTINGS];
+  int nprefetch = 0;
+  rigtorp::mpmc::Backend backend = rigtorp::mpmc::Backend::PmemObj;
+  const char* pool = PoolPath;
+  int npos = 0;
 
-  /** The first argument is nprocs. */
-  if (argc > 1) {
-    nprocs = atoi(argv[1]);
+  int i;
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--threads=", 10) == 0) {
+      nsweep = parse_threads(arg + 10, sweep);
+      if (nsweep <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(arg, "--format=text") == 0) {
+      format = FORMAT_TEXT;
+    } else if (strcmp(arg, "--format=csv") == 0) {
+      format = FORMAT_CSV;
+    } else if (strcmp(arg, "--format=json") == 0) {
+      format = FORMAT_JSON;
+    } else if (strncmp(arg, "--pool=", 7) == 0) {
+      pool = arg + 7;
+    } else if (strcmp(arg, "--volatile") == 0) {
+      backend = rigtorp::mpmc::Backend::Volatile;
+    } else if (strncmp(arg, "--backend=", 10) == 0) {
+      if (parse_backend(arg + 10, &backend) != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strncmp(arg, "--flush=", 8) == 0) {
+      nflush = parse_flush(arg + 8, flush);
+      if (nflush <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(arg, "--aggregate") == 0) {
+      aggregate[0] = 8;
+      naggregate = 1;
+    } else if (strncmp(arg, "--aggregate=", 12) == 0) {
+      naggregate = parse_settings(arg + 12, aggregate);
+      if (naggregate <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(arg, "--elim") == 0) {
+      elim[0] = 8;
+      nelim = 1;
+    } else if (strncmp(arg, "--elim=", 7) == 0) {
+      nelim = parse_settings(arg + 7, elim);
+      if (nelim <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strncmp(arg, "--prefetch=", 11) == 0) {
+      nprefetch = parse_settings(arg + 11, prefetch);
+      if (nprefetch <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(arg, "--perf") == 0) {
+      perf_enabled = 1;
+    } else if (strncmp(arg, "--perf-hitm=", 12) == 0) {
+      perf_enabled = 1;
+      perf_hitm_raw = strtoull(arg + 12, NULL, 0);
+    } else if (strncmp(arg, "--pin=", 6) == 0) {
+      if (topology_parse_policy(arg + 6, &pin_policy) != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strncmp(arg, "--", 2) == 0) {
+      usage(argv[0]);
+      return 1;
+    } else if (npos == 0) {
+      /** The first argument is nprocs. */
+      nprocs = atoi(arg);
+      npos++;
+    } else if (npos == 1) {
+      /** The second argument is input size n. */
+      n = atoi(arg);
+      npos++;
+    }
+  }
+
+  out = format == FORMAT_TEXT ? stdout : stderr;
+
+  if (pin_policy != PIN_LEGACY && topology_init(&topology, pin_policy) != 0) {
+    fprintf(stderr, "cpu topology unavailable, using cpumap()\n");
+    pin_policy = PIN_LEGACY;
   }
 
   /**
@@ -244,66 +822,210 @@ int main(int argc, const char* argv[]) {
     nprocs = sysconf(_SC_NPROCESSORS_ONLN);
   }
 
-  if (nprocs <= 0)
+  if (nsweep == 0) {
+    sweep[nsweep++] = nprocs;
+  }
+
+  int maxprocs = 0;
+  for (i = 0; i < nsweep; ++i) {
+    if (sweep[i] > maxprocs)
+      maxprocs = sweep[i];
+  }
+
+  if (maxprocs <= 0 || maxprocs > MAX_PROCS)
     return 1;
   else {
     /** Set concurrency level. */
-    pthread_setconcurrency(nprocs);
+    pthread_setconcurrency(maxprocs);
   }
 
-  /**
-   * The second argument is input size n.
-   */
-  if (argc > 2) {
-    n = atoi(argv[2]);
+  bool persistent = backend != rigtorp::mpmc::Backend::Volatile;
+  if (nflush > 0 && !persistent) {
+    fprintf(stderr, "--flush needs the persistent queue\n");
+    return 1;
+  }
+  flush_column = nflush > 0;
+  if (nelim > 0 && persistent) {
+    fprintf(stderr, "--elim needs the volatile queue\n");
+    return 1;
+  }
+  aggregate_column = naggregate > 0;
+  if (naggregate == 0)
+    aggregate[naggregate++] = 0;
+  elim_column = nelim > 0;
+  if (nelim == 0)
+    elim[nelim++] = 0;
+  prefetch_column = nprefetch > 0;
+  if (nprefetch == 0)
+    prefetch[nprefetch++] = 0;
+
+  open_us = elapsed_time(0);
+  q = std::make_unique<Queue>(SZ, backend, persistent ? pool : "");
+  open_us = elapsed_time(open_us);
+  if (nflush == 0)
+    flush[nflush++] = q->flush_strategy();
+  for (i = 0; persistent && !q->is_pmem() && i < nflush; ++i) {
+    if (flush[i] != rigtorp::mpmc::FlushStrategy::Auto &&
+        flush[i] != rigtorp::mpmc::FlushStrategy::Pool) {
+      fprintf(stderr, "%s: the pool is not on persistent memory, only "
+                      "--flush=auto:pool apply\n", argv[0]);
+      return 1;
+    }
   }
 
-  pthread_barrier_init(&barrier, NULL, nprocs);
-  printf("===========================================\n");
-  printf("  Benchmark: %s\n", argv[0]);
-  printf("  Number of processors: %d\n", nprocs);
+  fprintf(out, "===========================================\n");
+  fprintf(out, "  Benchmark: %s\n", argv[0]);
+  fprintf(out, "  CPU pinning: %s\n", topology_policy_name(pin_policy));
+  fprintf(out, "  Memory ordering: %s\n", STR(MPMC_ORDERING));
+  fprintf(out, "  Slot padding: %zu\n", Queue::padding);
+  fprintf(out, "  Backend: %s, open time: %.3f ms\n",
+          rigtorp::mpmc::backendName(backend), open_us / 1000.0);
+  if (persistent)
+    fprintf(out, "  Persistent Memory Support: %d\n", q->is_pmem());
 
-  init(nprocs, n);
+  init(maxprocs, n);
 
-  pthread_t ths[nprocs];
-  void* res[nprocs];
+  pthread_barrier_init(&pool_barrier, NULL, maxprocs);
+  pthread_t ths[maxprocs];
 
-  int i;
-  for (i = 1; i < nprocs; i++) {
-    pthread_create(&ths[i], NULL, thread, bits_join(i, nprocs));
+  for (i = 1; i < maxprocs; i++) {
+    pthread_create(&ths[i], NULL, thread, bits_join(i, maxprocs));
   }
 
-  res[0] = thread(bits_join(0, nprocs));
+  int e;
+  for (e = 0; e < PERF_NUM_EVENTS; ++e)
+    perf_available[e] = 1;
 
-  for (i = 1; i < nprocs; i++) {
-    pthread_join(ths[i], &res[i]);
-  }
+  pin(0, maxprocs);
+  thread_init(0, maxprocs);
 
-  if (target == 0) {
-    target = NUM_ITERS - 1;
-    double minCov = covs[target];
+  perf_counters_t pc;
+  perf_open_thread(&pc);
 
-    /** Pick the result that has the lowest CoV. */
-    int i;
-    for (i = NUM_ITERS; i < MAX_ITERS; ++i) {
-      if (covs[i] < minCov) {
-        minCov = covs[i];
-        target = i;
+  int nvariants = nflush * naggregate * nelim * nprefetch;
+  std::vector<struct summary_t> summaries(nsweep * nvariants);
+  int nsummaries = 0;
+  int ret = 0;
+
+  for (i = 0; i < nsweep * nvariants; ++i) {
+    int np = sweep[i % nsweep];
+    int variant = i / nsweep;
+    int agg = aggregate[variant / nflush % naggregate];
+    int cells = elim[variant / nflush / naggregate % nelim];
+    int pf = prefetch[variant / nflush / naggregate / nelim];
+
+    /**
+     * Every combination of flush strategy, aggregation, elimination and
+     * prefetch setting runs the whole thread sweep.
+     */
+    if (i % nsweep == 0 && persistent) {
+      q->set_flush_strategy(flush[variant % nflush]);
+      if (i > 0)
+        fprintf(out, "===========================================\n");
+      fprintf(out, "  Flush strategy: %s\n",
+              rigtorp::mpmc::flushStrategyName(q->flush_strategy()));
+    }
+    if (i % nsweep == 0 && aggregate_column) {
+      q->set_aggregator(nullptr);
+      aggregator.reset();
+      if (agg > 0) {
+        aggregator = std::make_unique<rigtorp::mpmc::TicketAggregator>(agg);
+        q->set_aggregator(aggregator.get());
       }
+      if (i > 0 && !persistent)
+        fprintf(out, "===========================================\n");
+      if (agg > 0)
+        fprintf(out, "  Ticket aggregation: %d cpus per group\n", agg);
+      else
+        fprintf(out, "  Ticket aggregation: off\n");
+    }
+    if (i % nsweep == 0) {
+      q->set_prefetch_distance(pf);
+      if (prefetch_column)
+        fprintf(out, "  Prefetch distance: %d\n", pf);
     }
+    if (i % nsweep == 0 && elim_column) {
+      q->set_elimination(nullptr);
+      elimination.reset();
+      if (cells > 0) {
+        elimination =
+            std::make_unique<rigtorp::mpmc::EliminationArray<void*>>(cells);
+        q->set_elimination(elimination.get());
+      }
+      if (i > 0 && !aggregate_column)
+        fprintf(out, "===========================================\n");
+      if (cells > 0)
+        fprintf(out, "  Elimination: %d cells\n", cells);
+      else
+        fprintf(out, "  Elimination: off\n");
+    }
+
+    /** Start every sweep point from an identical, empty queue. */
+    q->reset();
+    memset(times, 0, sizeof(times));
+    memset(means, 0, sizeof(means));
+    memset(covs, 0, sizeof(covs));
+    target = 0;
+    round_nprocs = np;
+    pthread_barrier_init(&barrier, NULL, np);
+
+    if (i > 0)
+      fprintf(out, "===========================================\n");
+    fprintf(out, "  Number of processors: %d\n", np);
+
+    pthread_barrier_wait(&pool_barrier);
+    results[0] = run(0, np, &pc);
+    pthread_barrier_wait(&pool_barrier);
+
+    pthread_barrier_destroy(&barrier);
+
+    summaries[i] = summarize(np);
+    summaries[i].flush = q->flush_strategy();
+    summaries[i].aggregate = agg;
+    summaries[i].elim = cells;
+    summaries[i].prefetch = pf;
+    nsummaries++;
+    print_persist_profile(np);
+    if (format == FORMAT_TEXT)
+      print_text(&summaries[i]);
+
+    ret |= verify(np, results);
   }
 
-  double mean = means[target];
-  double cov = covs[target];
-  int i1 = target - NUM_ITERS + 2;
-  int i2 = target + 1;
+  done = 1;
+  pthread_barrier_wait(&pool_barrier);
 
-  printf("  Steady-state iterations: %d~%d\n", i1, i2);
-  printf("  Coefficient of variation: %.2f\n", cov);
-  printf("  Number of measurements: %d\n", NUM_ITERS);
-  printf("  Mean of elapsed time: %.2f ms\n", mean);
-  printf("===========================================\n");
+  for (i = 1; i < maxprocs; i++) {
+    pthread_join(ths[i], NULL);
+  }
+
+  perf_close(&pc);
+  thread_exit(0, maxprocs);
+  pthread_barrier_destroy(&pool_barrier);
+
+  for (e = 0; perf_enabled && e < PERF_NUM_EVENTS; ++e) {
+    if (perf_available[e])
+      continue;
+    if (perf_errno[e] == EACCES || perf_errno[e] == EPERM)
+      fprintf(stderr,
+              "perf: %s unavailable: %s, see "
+              "/proc/sys/kernel/perf_event_paranoid\n",
+              perf_event_names[e], strerror(perf_errno[e]));
+    else if (perf_errno[e] != 0)
+      fprintf(stderr, "perf: %s unavailable: %s\n", perf_event_names[e],
+              strerror(perf_errno[e]));
+    else // not opened, only HITM needs an encoding
+      fprintf(stderr, "perf: %s unavailable: no --perf-hitm given\n",
+              perf_event_names[e]);
+  }
 
-  pthread_barrier_destroy(&barrier);
-  return verify(nprocs, res);
+  if (format == FORMAT_CSV)
+    print_csv(summaries.data(), nsummaries);
+  else if (format == FORMAT_JSON)
+    print_json(argv[0], summaries.data(), nsummaries);
+
+  // The queue detaches its aggregator and elimination array, destroy it
+  // before them
+  q.reset();
+  return ret;
 }